@@ -1,11 +1,19 @@
 #include <pebble.h>
 
 #define ACCEL_STEP_MS 30
-#define STEPS_IN_SECOND 1000 / ACCEL_STEP_MS
+#define MAX_CATCH_UP_STEPS 4
+#define MAX_SKIPPED_FRAMES 2
+#define READY_STEP_MS 1000
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
-#define ABS(a) ((a > 0) ? (a) : (-a))
+#define ABS(a) ((a) > 0 ? (a) : -(a))
+
+// Q8.8 fixed point for positions and velocities
+#define FIXED_SHIFT 8
+#define FIXED_ONE (1 << FIXED_SHIFT)
+#define TO_FIXED(a) ((a) * FIXED_ONE)
+#define FROM_FIXED(a) ((a) >> FIXED_SHIFT)
 
 #define CREEP_INITIAL_SCORE 10
 #define ARMOR_SELECTION 0
@@ -16,15 +24,32 @@
 #define DEFAULT_GUN 0
 #define DOUBLE_GUN 1
 #define TRIPLE_GUN 2
+#define FIRE_DOWN 0
+#define FIRE_AIMED 1
+#define FIRE_SPREAD 2
+#define FIRE_RING 3
+#define FIRE_PATTERN_COUNT 4
 #define INITIAL_SHIP_ARMOR 4
 #define INITIAL_READY_COUNT 3
-#define SHIP_MOVEMENT_SPEED 2
+#define SHIP_MAX_SPEED TO_FIXED(4)
+#define ACCEL_PER_PIXEL_SPEED 100
 #define SHIP_FIRE_TIME_LAG 10
 #define BULLET_RADIUS 1
 #define BULLET_WIDTH 2
-#define MAX_PLAYER_BULLETS 64
-#define MAX_CREEP_BULLETS 64
+#define PLAYER_BULLET_CAPACITY 64
+#define CREEP_BULLET_CAPACITY 64
+#define GRID_CELL_SHIFT 3
 #define ACCEL_MID 16
+#define ACCEL_SAMPLES_PER_UPDATE 4
+#define ACCEL_RING_SIZE 8
+#define ACCEL_FILTER_SHIFT 2
+#define BULLET_SPEED TO_FIXED(1)
+#define CREEP_FIRE_INTERVAL 100
+#define DIRECTION_COUNT 32
+#define DIRECTION_DOWN 8
+#define SPREAD_STEP 2
+#define RING_STEP 4
+#define LEVEL_SEED_STEP 0x9e3779b9
 #define INITIAL_MONEY 100
 #define INITIAL_GUN_POWER 1
 #define ASCII_ZERO 48
@@ -32,86 +57,319 @@
 #define DISTANCE 1
 #define MAX_ARMOR 10
 #define MAX_POWER 10
-
+#define MAX_DIRTY_RECTS 16
+#define MAX_TRAJECTORY_SEGMENTS 32
+#define MAX_SPRITE_WIDTH 32
+#define MAX_TRAJECTORY_TICKS 30000
+#define ARENA_ALIGN sizeof(void*)
+#define LEVEL_FILE_VERSION 3
+#define FNV_OFFSET_BASIS 0x811c9dc5
+#define FNV_PRIME 0x01000193
+#define HUD_TEXT_HEIGHT 16
+#define STORE_ROW_COUNT 5
+#define STORE_ROW_HEIGHT 16
+#define ARMOR_BAR_HEIGHT 2
+#define WEAK_MARKER_WIDTH 7
+#define WEAK_MARKER_HEIGHT 8
+
+// Keys of the one value per field saves of 1.1 and before, read once to
+// carry progress over
 #define SAVED_DATA_LEVEL_KEY 101
 #define SAVED_DATA_MONEY_KEY 102
 #define SAVED_DATA_ARMOR_KEY 103
 #define SAVED_DATA_GUN_KEY 104
 #define SAVED_DATA_POWER_KEY 105
+#define SAVED_GAME_KEY 110
+#define SAVED_GAME_VERSION 1
+// A snapshot takes up to SNAPSHOT_MAX_CHUNKS keys from SNAPSHOT_KEY on
+#define SNAPSHOT_KEY 120
+#define SNAPSHOT_MAX_CHUNKS 12
+#define SNAPSHOT_VERSION 1
+
+typedef int32_t Fixed;
 
 typedef enum { LevelState, StoreState, GetReadyState, GameOverState, TipState } GameState;
 
 Window* window;
 Layer* windowLayer;
 Layer* layer;
+Layer* hudLayer;
+TextLayer* levelTextLayer;
+TextLayer* moneyTextLayer;
+Layer* storeLayer;
+Layer* storeRows[STORE_ROW_COUNT];
+GFont textFont;
+GFont boldTextFont;
+// Every sprite is a piece of the atlas, the level file says where. Creep
+// sprites only exist while a creep of the loaded level uses them.
+typedef struct {
+  GRect rect;
+  GBitmap* bitmap;
+  // One word per row, bit x set where the sprite is black. Only those
+  // pixels can be hit.
+  uint32_t* mask;
+  // FIRE_DOWN, FIRE_AIMED, FIRE_SPREAD or FIRE_RING, for creep types
+  uint8_t firePattern;
+  int references;
+} Sprite;
+
+GBitmap* spriteAtlas;
 GBitmap* ship;
-GBitmap* creepBitmap[4];
+uint32_t* shipMask;
+// The rows of every sprite's mask, the ship's first
+uint32_t* spriteMasks;
+Sprite* creepSprites;
+int creepTypeCount;
+// Only loaded while the tip is shown
 GBitmap* tipBitmap;
 AppTimer* timer;
+AppTimer* readyTimer;
 GRect windowBounds;
 GRect shipBounds;
 GRect bulletBounds;
-AccelData accelData;
+
+// Accelerometer samples arrive in batches and wait here until the next
+// game step folds them into the filtered tilt. When steps stop the oldest
+// samples are overwritten.
+typedef struct {
+  int16_t x[ACCEL_RING_SIZE];
+  int head;
+  int count;
+} AccelRing;
+
+AccelRing accelRing;
+bool accelSubscribed = false;
+// Low-passed x tilt, each sample moves it 1/4 of the way
+Fixed accelTilt = 0;
 
 int padding = 8;
 int possibleNextPosition;
+Fixed shipX;
 int rightWall, leftWall, topWall, bottomWall;
 int bottom;
 
 int lastPlayerFireTime = 0;
 
 int creepScore = CREEP_INITIAL_SCORE;
-int creepsLeft;
 
+// What the HUD currently shows, its text is only rebuilt on change
 char moneyText[12];
-char levelText[8];
+char levelText[16];
+int hudMoney = -1;
+int hudLevel = -1;
 
 int gameTime = 0;
+// Creep fire timing comes from this generator alone, so a level run
+// replays exactly from the same seed. gameSeed is picked at start up
+// unless it was set before, each level run is seeded from it.
+uint32_t gameSeed = 0;
+uint32_t randomState = 1;
+// Wall clock time the next game step is due at. A late wakeup runs the
+// steps it owes, up to MAX_CATCH_UP_STEPS, and anything beyond that is
+// dropped and counted as an overrun. Frames are skipped while the loop
+// is behind, at most MAX_SKIPPED_FRAMES in a row.
+uint32_t nextStepTime;
+int loopOverruns = 0;
+int skippedFrames = 0;
+int framesSkippedInRow = 0;
 char readyText[4];
-int readyStepsLeft = STEPS_IN_SECOND;
 int readyCount = INITIAL_READY_COUNT;
 int storeSelectionCosts[4] = {100, 200, 300, 500};
+const char* storeLabels[STORE_ROW_COUNT] = {"Armor", "Power Up", "Double Gun", "Triple Gun", "Done"};
+const char* storePrices[STORE_ROW_COUNT] = {"$100", "$200", "$300", "$500", NULL};
 int storeSelection = 0;
 bool isPaused = false;
+// Sprites and levels are loaded once the first frame is up
+bool gameLoaded = false;
+bool gameLoadScheduled = false;
+
+// Regions of the playfield that changed since the last frame. The window
+// background is clear so the frame buffer is kept between frames and only
+// these regions get erased and repainted.
+GRect dirtyRects[MAX_DIRTY_RECTS];
+int dirtyRectCount = 0;
+bool fullRedraw = true;
+bool redrawRequested = false;
+// Store rows to repaint, one bit per row and one for the title. The
+// layers are repainted with every frame, the rest keep their pixels.
+#define STORE_TITLE_DIRTY (1 << STORE_ROW_COUNT)
+uint8_t storeDirty = 0xff;
+
+// Live bullets are kept packed at the front of the arrays, so adding one
+// is an append and removing one swaps the last live bullet into its slot.
+// A full pool drops new shots and counts them as overflows.
+typedef struct {
+  Fixed* x;
+  Fixed* y;
+  Fixed* vx;
+  Fixed* vy;
+  int count;
+  int capacity;
+  int overflows;
+} BulletPool;
+
+// Level file layout, written by tools/levelc.py. Records are little-endian
+// and laid out like the structs in memory, so a level block is read
+// straight into the level arena and used in place.
+typedef struct {
+  char magic[4];
+  uint16_t version;
+  uint16_t levelCount;
+  uint32_t checksum;
+  uint32_t size;
+  uint16_t spriteCount;
+  uint16_t reserved;
+} LevelFileHeader;
+
+// Sprite rectangles in the atlas follow the offsets, laid out like a GRect.
+// The ship comes first, then one sprite per creep type. A creep type's fire
+// pattern comes with its sprite, the ship's is unused.
+typedef struct {
+  GRect rect;
+  uint8_t firePattern;
+  uint8_t reserved;
+} SpriteRecord;
 
 typedef struct {
-  bool visible;
-  GPoint pos;
-  GPoint vel;
-} Bullet;
+  uint16_t creepCount;
+  uint16_t ruleCount;
+} LevelRecord;
 
 typedef struct {
-  GPoint delta;
-  int conditionType;
-  int distance;
+  int16_t x;
+  int16_t y;
+  uint16_t firstRule;
+  uint8_t ruleCount;
+  uint8_t health;
+  uint8_t type;
+  uint8_t reserved[3];
+} CreepRecord;
+
+typedef struct {
+  Fixed dx;
+  Fixed dy;
+  uint16_t distance;
+  uint8_t conditionType;
+  uint8_t reserved;
 } MovementRule;
 
+// Bump allocator holding the loaded level. Everything in it is released
+// at once by resetting it.
+typedef struct {
+  uint8_t* base;
+  size_t size;
+  size_t used;
+  size_t highWater;
+} Arena;
+
+// A run of ticks moving by the same delta. Positions are offsets from the
+// creep's initial position.
+typedef struct {
+  Fixed dx;
+  Fixed dy;
+  Fixed x;
+  Fixed y;
+  uint16_t ticks;
+  uint16_t startTick;
+} TrajectorySegment;
+
+// A creep's rule cycle unrolled when the rules are loaded. After the last
+// segment the creep continues at loopSegment, which is segment 0 when the
+// rules end with the creep being reset.
+typedef struct {
+  TrajectorySegment* segments;
+  int segmentCount;
+  int loopSegment;
+  int length;
+  int period;
+} Trajectory;
+
+// Creeps with the same moves from the same table move in lockstep, so
+// the table is stepped once per tick for all of them. The position is an
+// offset from each member's initial position.
+typedef struct {
+  Trajectory* trajectory;
+  MovementRule* rules;
+  Fixed x;
+  Fixed y;
+  uint16_t segmentTick;
+  uint8_t segment;
+} Formation;
+
+// Where a creep starts a level from. Only resets, formations and the rule
+// interpreter look at it. Creeps with the same moves share their rules.
 typedef struct {
-  int health;
   GPoint initialPosition;
-  GRect bounds;
   MovementRule* rules;
   int ruleCount;
-  int currentRule;
-  int traveled;
   int fullHealth;
-  int type;
+} CreepSpawn;
+
+// What the game step reads and writes for a creep, kept apart from the
+// spawn data so the creeps being stepped sit close together
+typedef struct {
+  Fixed x;
+  Fixed y;
+  GRect bounds;
+  int16_t health;
+  int16_t fireCountdown;
+  Formation* formation;
+  uint8_t currentRule;
+  Fixed traveled;
+  uint8_t type;
+  CreepSpawn* spawn;
 } Creep;
 
+// The step, hit checks and drawing only walk the live creeps. Their
+// indices are packed at the front of live, a killed creep's slot takes
+// the last live index.
 typedef struct {
   Creep* creeps;
+  CreepSpawn* spawns;
+  uint16_t* live;
+  int liveCount;
   int creepCount;
+  Formation* formations;
+  int formationCount;
 } Level;
 
+// Only the level being played is kept in memory, the others are found
+// through levelOffsets and loaded from the resource into levelArena
 typedef struct {
   GameState state;
-  Level* levels;
+  Level level;
+  int loadedLevel;
+  uint32_t levelFileChecksum;
+  uint32_t* levelOffsets;
+  Arena levelArena;
   int levelCount;
   int currentLevel;
 } Game;
 
-Bullet playerBullets[MAX_PLAYER_BULLETS];
-Bullet creepBullets[MAX_CREEP_BULLETS];
+BulletPool playerBullets;
+BulletPool creepBullets;
+
+// Uniform grid of 8x8 cells, rebuilt from one bullet pool at a time.
+// Each cell heads a chain of bullet indices linked through next.
+typedef struct {
+  int16_t* head;
+  int16_t* next;
+  uint8_t* hit;
+  int columns;
+  int rows;
+} BulletGrid;
+
+BulletGrid bulletGrid;
+
+// The captured frame buffer, as 32 bit words of 1-bit pixels, least
+// significant bit first and set bits white. top is the screen row the
+// window starts at.
+typedef struct {
+  GBitmap* bitmap;
+  uint32_t* words;
+  int wordsPerRow;
+  int top;
+} FrameBuffer;
 
 typedef struct {
   int armor;
@@ -119,95 +377,618 @@ typedef struct {
   int money;
 } Player;
 
+// Progress kept between sessions, written whole with one persist call
+typedef struct {
+  uint8_t version;
+  uint8_t gunType;
+  uint8_t gunPower;
+  uint8_t fullArmor;
+  uint16_t currentLevel;
+  uint16_t reserved;
+  int32_t money;
+} SavedGame;
+
+// The world in the middle of a level, saved on exit and restored on the
+// next launch. The header is followed by a CreepSnapshot per creep and a
+// BulletSnapshot per player bullet, then per creep bullet.
+typedef struct {
+  uint16_t version;
+  uint16_t size;
+  uint32_t checksum;
+  uint32_t levelFileChecksum;
+  uint16_t currentLevel;
+  uint16_t creepCount;
+  uint16_t playerBulletCount;
+  uint16_t creepBulletCount;
+  int32_t gameTime;
+  Fixed shipX;
+  uint32_t randomState;
+  int16_t armor;
+  int16_t creepsLeft;
+  int16_t lastPlayerFireTime;
+  int16_t reserved;
+} SnapshotHeader;
+
+typedef struct {
+  Fixed x;
+  Fixed y;
+  Fixed traveled;
+  int16_t health;
+  int16_t fireCountdown;
+  uint8_t currentRule;
+  uint8_t segment;
+  uint16_t segmentTick;
+} CreepSnapshot;
+
+typedef struct {
+  Fixed x;
+  Fixed y;
+  Fixed vx;
+  Fixed vy;
+} BulletSnapshot;
+
 int gunType = DEFAULT_GUN;
-int currentPlayerBullet = 0;
 int currentGunPower = INITIAL_GUN_POWER;
-int currentCreepBullet = 0;
 
 GPoint weakPoints[10] = {
   {0,4}, {1,1}, {1,7}, {2,5}, {3,4},
   {3,7}, {4,0}, {5,4}, {6,1}, {6,7}
 };
+#define WEAK_ROWS 8
+#define WEAK_WIDTH 7
+// weakPoints as one bit mask per row, built in handle_init
+uint32_t weakRows[WEAK_ROWS];
+
+#define BULLET_STAMP_SIZE 2
+const uint32_t bulletRows[BULLET_STAMP_SIZE] = { 0x3, 0x3 };
 
 Game game;
 Player player;
 
+// What is in storage, so unchanged progress isn't written again
+SavedGame storedGame;
+
+SavedGame currentSavedGame(){
+  SavedGame saved;
+  memset(&saved, 0, sizeof(saved));
+  saved.version = SAVED_GAME_VERSION;
+  saved.gunType = gunType;
+  saved.gunPower = currentGunPower;
+  saved.fullArmor = player.fullArmor;
+  saved.currentLevel = game.currentLevel;
+  saved.money = player.money;
+  return saved;
+}
+
 void saveState(){
-  persist_write_int(SAVED_DATA_LEVEL_KEY, game.currentLevel);
-  persist_write_int(SAVED_DATA_MONEY_KEY, player.money);
-  persist_write_int(SAVED_DATA_ARMOR_KEY, player.fullArmor);
-  persist_write_int(SAVED_DATA_GUN_KEY, gunType);
-  persist_write_int(SAVED_DATA_POWER_KEY, currentGunPower);
+  SavedGame saved = currentSavedGame();
+  if(memcmp(&saved, &storedGame, sizeof(saved)) == 0) return;
+  if(persist_write_data(SAVED_GAME_KEY, &saved, sizeof(saved)) == sizeof(saved)) storedGame = saved;
+}
+
+// Value if it is within min and max, otherwise the fallback
+int inRangeOr(int value, int min, int max, int fallback){
+  return value >= min && value <= max ? value : fallback;
+}
+
+// Storage can hold anything, and zero armor or power would divide by zero
+void checkLoadedState(){
+  game.currentLevel = inRangeOr(game.currentLevel, 0, UINT16_MAX, 0);
+  player.fullArmor = inRangeOr(player.fullArmor, INITIAL_SHIP_ARMOR, MAX_ARMOR, INITIAL_SHIP_ARMOR);
+  gunType = inRangeOr(gunType, DEFAULT_GUN, TRIPLE_GUN, DEFAULT_GUN);
+  currentGunPower = inRangeOr(currentGunPower, INITIAL_GUN_POWER, MAX_POWER, INITIAL_GUN_POWER);
+}
+
+void loadOldState(){
+  game.currentLevel = persist_read_int(SAVED_DATA_LEVEL_KEY);
+  player.money = persist_read_int(SAVED_DATA_MONEY_KEY);
+  player.fullArmor = persist_read_int(SAVED_DATA_ARMOR_KEY);
+  gunType = persist_read_int(SAVED_DATA_GUN_KEY);
+  currentGunPower = persist_read_int(SAVED_DATA_POWER_KEY);
+  checkLoadedState();
+  saveState();
+  for(uint32_t key = SAVED_DATA_LEVEL_KEY; key <= SAVED_DATA_POWER_KEY; key++) persist_delete(key);
 }
 
 void loadState(){
-  if(persist_exists(SAVED_DATA_LEVEL_KEY)){
-    game.currentLevel = persist_read_int(SAVED_DATA_LEVEL_KEY);
-    player.money = persist_read_int(SAVED_DATA_MONEY_KEY);
-    player.fullArmor = persist_read_int(SAVED_DATA_ARMOR_KEY);
-    gunType = persist_read_int(SAVED_DATA_GUN_KEY);
-    currentGunPower = persist_read_int(SAVED_DATA_POWER_KEY);
+  SavedGame saved;
+  if(persist_read_data(SAVED_GAME_KEY, &saved, sizeof(saved)) == sizeof(saved) &&
+      saved.version == SAVED_GAME_VERSION){
+    storedGame = saved;
+    game.currentLevel = saved.currentLevel;
+    player.money = saved.money;
+    player.fullArmor = saved.fullArmor;
+    gunType = saved.gunType;
+    currentGunPower = saved.gunPower;
+    checkLoadedState();
+  }else if(persist_exists(SAVED_DATA_LEVEL_KEY)){
+    loadOldState();
+  }
+}
+
+GRect unionRect(GRect a, GRect b){
+  int x = MIN(a.origin.x, b.origin.x);
+  int y = MIN(a.origin.y, b.origin.y);
+  int right = MAX(a.origin.x + a.size.w, b.origin.x + b.size.w);
+  int bottom = MAX(a.origin.y + a.size.h, b.origin.y + b.size.h);
+  return GRect(x, y, right - x, bottom - y);
+}
+
+// True if the rects overlap or share an edge
+bool rectsTouch(GRect* a, GRect* b){
+  return a->origin.x <= b->origin.x + b->size.w && b->origin.x <= a->origin.x + a->size.w &&
+    a->origin.y <= b->origin.y + b->size.h && b->origin.y <= a->origin.y + a->size.h;
+}
+
+bool rectsIntersect(GRect* a, GRect* b){
+  return a->origin.x < b->origin.x + b->size.w && b->origin.x < a->origin.x + a->size.w &&
+    a->origin.y < b->origin.y + b->size.h && b->origin.y < a->origin.y + a->size.h;
+}
+
+int rectArea(GRect rect){
+  return rect.size.w * rect.size.h;
+}
+
+GRect clipToWindow(GRect rect){
+  int x = MAX(rect.origin.x, 0);
+  int y = MAX(rect.origin.y, 0);
+  int right = MIN(rect.origin.x + rect.size.w, windowBounds.size.w);
+  int bottom = MIN(rect.origin.y + rect.size.h, windowBounds.size.h);
+  return GRect(x, y, MAX(right - x, 0), MAX(bottom - y, 0));
+}
+
+void markAllDirty(){
+  fullRedraw = true;
+  storeDirty = 0xff;
+}
+
+void markDirty(GRect rect){
+  if(fullRedraw) return;
+  rect = clipToWindow(rect);
+  if(rectArea(rect) == 0) return;
+  // Grow a touching rect if we can
+  for(int i = 0; i < dirtyRectCount; i++){
+    if(rectsTouch(&dirtyRects[i], &rect)){
+      dirtyRects[i] = unionRect(dirtyRects[i], rect);
+      return;
+    }
+  }
+  if(dirtyRectCount < MAX_DIRTY_RECTS){
+    dirtyRects[dirtyRectCount++] = rect;
+    return;
+  }
+  // List is full, fold into whichever rect grows the least
+  int best = 0;
+  int bestGrowth = -1;
+  for(int i = 0; i < dirtyRectCount; i++){
+    int growth = rectArea(unionRect(dirtyRects[i], rect)) - rectArea(dirtyRects[i]);
+    if(bestGrowth == -1 || growth < bestGrowth){
+      best = i;
+      bestGrowth = growth;
+    }
+  }
+  dirtyRects[best] = unionRect(dirtyRects[best], rect);
+}
+
+// Coalesce touching rects so nothing gets erased and drawn twice
+void mergeDirtyRects(){
+  bool merged = true;
+  while(merged){
+    merged = false;
+    for(int i = 0; i < dirtyRectCount; i++){
+      for(int j = i + 1; j < dirtyRectCount; j++){
+        if(rectsTouch(&dirtyRects[i], &dirtyRects[j])){
+          dirtyRects[i] = unionRect(dirtyRects[i], dirtyRects[j]);
+          dirtyRects[j] = dirtyRects[--dirtyRectCount];
+          merged = true;
+          j--;
+        }
+      }
+    }
+  }
+}
+
+bool isDirty(GRect rect){
+  if(fullRedraw) return true;
+  for(int i = 0; i < dirtyRectCount; i++)
+    if(rectsIntersect(&dirtyRects[i], &rect)) return true;
+  return false;
+}
+
+void clearDirtyRects(){
+  dirtyRectCount = 0;
+  fullRedraw = false;
+}
+
+GRect bulletRect(GPoint pos){
+  return GRect(pos.x - BULLET_RADIUS, pos.y - BULLET_RADIUS, BULLET_RADIUS * 2 + 1, BULLET_RADIUS * 2 + 1);
+}
+
+// Sprite bounds grown to cover the weak point marker
+GRect spriteRect(GRect bounds){
+  bounds.size.w = MAX(bounds.size.w, WEAK_MARKER_WIDTH);
+  bounds.size.h = MAX(bounds.size.h, WEAK_MARKER_HEIGHT);
+  return bounds;
+}
+
+GRect armorBarRect(){
+  return GRect(0, windowBounds.size.h - ARMOR_BAR_HEIGHT, windowBounds.size.w, ARMOR_BAR_HEIGHT);
+}
+
+GRect readyTextRect(){
+  return GRect(windowBounds.size.w / 2, windowBounds.size.h / 2, 16, 16);
+}
+
+uint32_t currentTimeMs(){
+  time_t seconds;
+  uint16_t milliseconds;
+  time_ms(&seconds, &milliseconds);
+  return (uint32_t)seconds * 1000 + milliseconds;
+}
+
+// Instrumentation, built with PHOENIX_PROFILE defined. Times the phases
+// of a game step and each frame, samples bullet and creep counts, keeps
+// the heap high water of each game state and counts accelerometer
+// samples dropped from the ring during play. Everything is logged and
+// reset every PROFILE_DUMP_MS, or when up and down are held together,
+// along with the bullets full pools have dropped so far.
+#ifdef PHOENIX_PROFILE
+
+#define PROFILE_DUMP_MS 30000
+#define PROFILE_BUCKETS 8
+// Phases are timed in milliseconds, a host can time them with a finer clock
+#ifndef PROFILE_CLOCK
+#define PROFILE_CLOCK() currentTimeMs()
+#endif
+#define GAME_STATE_COUNT (TipState + 1)
+
+typedef enum {
+  ProfileBullets, ProfileShip, ProfileCreeps, ProfileHits, ProfileFire, ProfileDraw,
+  ProfileBulletCount, ProfileCreepCount, ProfileStatCount
+} ProfileStatId;
+
+const char* profileStatNames[ProfileStatCount] = {
+  "bullets ms", "ship ms", "creeps ms", "hits ms", "fire ms", "draw ms", "bullet count", "creep count"
+};
+
+// Bucket 0 counts zeros, bucket n values from 2^(n-1) up to 2^n - 1, the
+// last one everything larger
+typedef struct {
+  uint32_t samples;
+  uint32_t total;
+  uint32_t min;
+  uint32_t max;
+  uint32_t buckets[PROFILE_BUCKETS];
+} ProfileStat;
+
+ProfileStat profileStats[ProfileStatCount];
+size_t profileHeapPeak[GAME_STATE_COUNT];
+uint32_t profileRingOverwrites;
+uint32_t profileStartTime;
+uint8_t profileButtonsHeld;
+
+void profileReset(){
+  memset(profileStats, 0, sizeof(profileStats));
+  memset(profileHeapPeak, 0, sizeof(profileHeapPeak));
+  profileRingOverwrites = 0;
+  profileStartTime = currentTimeMs();
+}
+
+void profileSample(ProfileStatId id, uint32_t value){
+  ProfileStat* stat = &profileStats[id];
+  if(stat->samples == 0 || value < stat->min) stat->min = value;
+  if(value > stat->max) stat->max = value;
+  stat->samples++;
+  stat->total += value;
+  int bucket = 0;
+  for(uint32_t rest = value; rest > 0 && bucket < PROFILE_BUCKETS - 1; rest >>= 1) bucket++;
+  stat->buckets[bucket]++;
+}
+
+// Records the time since lap, returns the time the next phase starts at
+uint32_t profileLap(ProfileStatId id, uint32_t lap){
+  uint32_t now = PROFILE_CLOCK();
+  profileSample(id, now - lap);
+  return now;
+}
+
+void profileHeap(GameState state){
+  size_t used = heap_bytes_used();
+  if(used > profileHeapPeak[state]) profileHeapPeak[state] = used;
+}
+
+void profileDump(){
+  APP_LOG(APP_LOG_LEVEL_INFO, "Profile of the last %u ms, %d loop overruns and %d skipped frames in total",
+    (unsigned)(currentTimeMs() - profileStartTime), loopOverruns, skippedFrames);
+  for(int id = 0; id < ProfileStatCount; id++){
+    ProfileStat* stat = &profileStats[id];
+    if(stat->samples == 0) continue;
+    // Phases mostly take less than the clock's millisecond, the average
+    // over many samples is finer
+    uint32_t average = (uint32_t)((uint64_t)stat->total * 1000 / stat->samples);
+    uint32_t* b = stat->buckets;
+    APP_LOG(APP_LOG_LEVEL_INFO, "%s: %u samples min %u avg %u.%03u max %u | 0:%u 1:%u 2:%u 4:%u 8:%u 16:%u 32:%u 64+:%u",
+      profileStatNames[id], (unsigned)stat->samples, (unsigned)stat->min, (unsigned)(average / 1000),
+      (unsigned)(average % 1000), (unsigned)stat->max, (unsigned)b[0], (unsigned)b[1], (unsigned)b[2],
+      (unsigned)b[3], (unsigned)b[4], (unsigned)b[5], (unsigned)b[6], (unsigned)b[7]);
+  }
+  APP_LOG(APP_LOG_LEVEL_INFO, "Heap high water level %d store %d ready %d game over %d tip %d, %u accel samples dropped",
+    (int)profileHeapPeak[LevelState], (int)profileHeapPeak[StoreState], (int)profileHeapPeak[GetReadyState],
+    (int)profileHeapPeak[GameOverState], (int)profileHeapPeak[TipState], (unsigned)profileRingOverwrites);
+  APP_LOG(APP_LOG_LEVEL_INFO, "Bullets dropped from full pools in total, %d player and %d creep",
+    playerBullets.overflows, creepBullets.overflows);
+  profileReset();
+}
+
+void profileDumpIfDue(){
+  if(currentTimeMs() - profileStartTime >= PROFILE_DUMP_MS) profileDump();
+}
+
+void profile_button_down_handler(ClickRecognizerRef recognizer, void *context){
+  profileButtonsHeld |= 1 << click_recognizer_get_button_id(recognizer);
+  uint8_t chord = (1 << BUTTON_ID_UP) | (1 << BUTTON_ID_DOWN);
+  if((profileButtonsHeld & chord) == chord) profileDump();
+}
+
+void profile_button_up_handler(ClickRecognizerRef recognizer, void *context){
+  profileButtonsHeld &= ~(1 << click_recognizer_get_button_id(recognizer));
+}
+
+#define PROFILE_START(lap) uint32_t lap = PROFILE_CLOCK()
+#define PROFILE_LAP(id, lap) lap = profileLap(id, lap)
+#define PROFILE_SAMPLE(id, value) profileSample(id, value)
+#define PROFILE_HEAP(state) profileHeap(state)
+#define PROFILE_RING_OVERWRITE() profileRingOverwrites++
+#define PROFILE_DUMP_IF_DUE() profileDumpIfDue()
+#define PROFILE_RESET() profileReset()
+
+#else
+
+#define PROFILE_START(lap)
+#define PROFILE_LAP(id, lap)
+#define PROFILE_SAMPLE(id, value)
+#define PROFILE_HEAP(state)
+#define PROFILE_RING_OVERWRITE()
+#define PROFILE_DUMP_IF_DUE()
+#define PROFILE_RESET()
+
+#endif
+
+void setGameState(GameState state){
+  PROFILE_HEAP(game.state);
+  game.state = state;
+  markAllDirty();
+  if(state == TipState && tipBitmap == NULL){
+    tipBitmap = gbitmap_create_with_resource(RESOURCE_ID_TIP_IMAGE);
+  }else if(state != TipState && tipBitmap != NULL){
+    gbitmap_destroy(tipBitmap);
+    tipBitmap = NULL;
+  }
+  layer_set_hidden(hudLayer, state == TipState);
+  layer_set_hidden(storeLayer, state != StoreState);
+  PROFILE_HEAP(state);
+}
+
+size_t arenaAlign(size_t size){
+  return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arenaInit(Arena* arena, size_t size){
+  arena->base = malloc(size);
+  arena->size = arena->base ? size : 0;
+  arena->used = 0;
+  arena->highWater = 0;
+}
+
+void arenaDestroy(Arena* arena){
+  free(arena->base);
+  arena->base = NULL;
+  arena->size = arena->used = 0;
+}
+
+void arenaReset(Arena* arena){
+  arena->used = 0;
+}
+
+size_t arenaRemaining(Arena* arena){
+  return arena->size - arena->used;
+}
+
+// Where the next allocation will start, usable as scratch space
+void* arenaTail(Arena* arena){
+  return arena->base + arena->used;
+}
+
+void* arenaAlloc(Arena* arena, size_t size){
+  size = arenaAlign(size);
+  if(size > arenaRemaining(arena)) return NULL;
+  void* block = arenaTail(arena);
+  arena->used += size;
+  arena->highWater = MAX(arena->highWater, arena->used);
+  return block;
+}
+
+void bulletPoolInit(BulletPool* pool, int capacity){
+  // One block for all four arrays
+  pool->x = malloc(sizeof(Fixed) * capacity * 4);
+  pool->y = pool->x + capacity;
+  pool->vx = pool->y + capacity;
+  pool->vy = pool->vx + capacity;
+  pool->count = 0;
+  pool->capacity = capacity;
+  pool->overflows = 0;
+}
+
+void bulletPoolDestroy(BulletPool* pool){
+  free(pool->x);
+  pool->x = pool->y = pool->vx = pool->vy = NULL;
+  pool->count = pool->capacity = 0;
+}
+
+GPoint bulletPosition(BulletPool* pool, int index){
+  return GPoint(FROM_FIXED(pool->x[index]), FROM_FIXED(pool->y[index]));
+}
+
+int bulletPoolAdd(BulletPool* pool, Fixed x, Fixed y, Fixed vx, Fixed vy){
+  if(pool->count == pool->capacity){
+    pool->overflows++;
+    return -1;
   }
+  int index = pool->count++;
+  pool->x[index] = x;
+  pool->y[index] = y;
+  pool->vx[index] = vx;
+  pool->vy[index] = vy;
+  markDirty(bulletRect(bulletPosition(pool, index)));
+  return index;
 }
 
-void forEachPlayerBullet(void (*f)(Bullet*)){
-  for(int index = 0; index < MAX_PLAYER_BULLETS; index++)
-    (*f)(&playerBullets[index]);
+// Moves the last live bullet into this slot, so walk the pool backwards
+// when removing while iterating
+void bulletPoolRemove(BulletPool* pool, int index){
+  markDirty(bulletRect(bulletPosition(pool, index)));
+  int last = --pool->count;
+  pool->x[index] = pool->x[last];
+  pool->y[index] = pool->y[last];
+  pool->vx[index] = pool->vx[last];
+  pool->vy[index] = pool->vy[last];
+}
+
+void bulletPoolClear(BulletPool* pool){
+  for(int i = 0; i < pool->count; i++)
+    markDirty(bulletRect(bulletPosition(pool, i)));
+  pool->count = 0;
+}
+
+bool gameLoopShouldRun(){
+  return game.state == LevelState && !isPaused;
+}
+
+void accel_data_handler(AccelData* data, uint32_t num_samples){
+  for(uint32_t i = 0; i < num_samples; i++){
+    // Readings taken while vibrating are noise
+    if(data[i].did_vibrate) continue;
+    accelRing.x[(accelRing.head + accelRing.count) % ACCEL_RING_SIZE] = data[i].x;
+    if(accelRing.count < ACCEL_RING_SIZE){
+      accelRing.count++;
+    }else{
+      accelRing.head = (accelRing.head + 1) % ACCEL_RING_SIZE;
+      // Outside play nothing drains the ring, filling it up is expected
+      if(gameLoopShouldRun()){
+        PROFILE_RING_OVERWRITE();
+      }
+    }
+  }
 }
 
-void forEachCreepBullet(void (*f)(Bullet*)){
-  for(int index = 0; index < MAX_CREEP_BULLETS; index++)
-    (*f)(&creepBullets[index]);
+void filterAccelSamples(){
+  for(; accelRing.count > 0; accelRing.count--){
+    accelTilt += (TO_FIXED(accelRing.x[accelRing.head]) - accelTilt) >> ACCEL_FILTER_SHIFT;
+    accelRing.head = (accelRing.head + 1) % ACCEL_RING_SIZE;
+  }
 }
 
 void updateShipPosition(){
-  accel_service_peek(&accelData);
-  if(ABS(accelData.x) > ACCEL_MID){
-    int movement = accelData.x < 0 ? -SHIP_MOVEMENT_SPEED : SHIP_MOVEMENT_SPEED;
-    possibleNextPosition = shipBounds.origin.x + movement;
-    shipBounds.origin.x = MAX(MIN(possibleNextPosition, rightWall), padding);
+  filterAccelSamples();
+  int tiltX = FROM_FIXED(accelTilt);
+  if(ABS(tiltX) > ACCEL_MID){
+    // Speed grows with the tilt past the dead zone
+    int tilt = tiltX < 0 ? tiltX + ACCEL_MID : tiltX - ACCEL_MID;
+    Fixed movement = TO_FIXED(tilt) / ACCEL_PER_PIXEL_SPEED;
+    movement = MAX(MIN(movement, SHIP_MAX_SPEED), -SHIP_MAX_SPEED);
+    shipX = MAX(MIN(shipX + movement, TO_FIXED(rightWall)), TO_FIXED(padding));
+    possibleNextPosition = FROM_FIXED(shipX);
+    if(possibleNextPosition != shipBounds.origin.x){
+      markDirty(spriteRect(shipBounds));
+      shipBounds.origin.x = possibleNextPosition;
+      markDirty(spriteRect(shipBounds));
+    }
   }
 }
 
-void updateBullet(Bullet* bullet){
-  if(bullet->visible){
-    if(grect_contains_point(&windowBounds, &bullet->pos)){
-      bullet->pos.x += bullet->vel.x;
-      bullet->pos.y += bullet->vel.y;
+void updateBullets(BulletPool* pool){
+  for(int i = pool->count - 1; i >= 0; i--){
+    GPoint pos = bulletPosition(pool, i);
+    if(grect_contains_point(&windowBounds, &pos)){
+      markDirty(bulletRect(pos));
+      pool->x[i] += pool->vx[i];
+      pool->y[i] += pool->vy[i];
+      markDirty(bulletRect(bulletPosition(pool, i)));
     }else{
-      bullet->visible = false;
+      bulletPoolRemove(pool, i);
     }
   }
 }
 
-// Might want to use a bitvector to assign visible or not...
-// Update velocity for special types, will need time...
-// position might need ot be float...  
+void firePlayerGunAt(int x, int y, Fixed vx, Fixed vy){
+  bulletPoolAdd(&playerBullets, TO_FIXED(x), TO_FIXED(y), vx, vy);
+}
 
-void fireBullet(Bullet* bullet, int x, int y, int vx, int vy){
-  bullet->visible = true;
-  bullet->pos.x = x;
-  bullet->pos.y = y;
-  bullet->vel.x = vx;
-  bullet->vel.y = vy;
+// Fixed point unit vectors, direction i is i/32 of a turn from right
+// towards down
+const GPoint directions[DIRECTION_COUNT] = {
+  {256, 0}, {251, 50}, {237, 98}, {213, 142},
+  {181, 181}, {142, 213}, {98, 237}, {50, 251},
+  {0, 256}, {-50, 251}, {-98, 237}, {-142, 213},
+  {-181, 181}, {-213, 142}, {-237, 98}, {-251, 50},
+  {-256, 0}, {-251, -50}, {-237, -98}, {-213, -142},
+  {-181, -181}, {-142, -213}, {-98, -237}, {-50, -251},
+  {0, -256}, {50, -251}, {98, -237}, {142, -213},
+  {181, -181}, {213, -142}, {237, -98}, {251, -50}
+};
+// tan of the boundaries between the directions of the first octant, Q8.8
+const int16_t octantTangents[4] = { 25, 78, 137, 210 };
+
+// The direction closest to (dx, dy), found without division: fold it into
+// the first octant, count the boundaries below it and unfold
+int directionTo(int dx, int dy){
+  int ax = abs(dx);
+  int ay = abs(dy);
+  int small = MIN(ax, ay);
+  int large = MAX(ax, ay);
+  if(large == 0) return DIRECTION_DOWN;
+  int direction = 0;
+  while(direction < 4 && small * 256 > octantTangents[direction] * large) direction++;
+  if(ay > ax) direction = DIRECTION_COUNT / 4 - direction;
+  if(dx < 0) direction = DIRECTION_COUNT / 2 - direction;
+  if(dy < 0) direction = (DIRECTION_COUNT - direction) % DIRECTION_COUNT;
+  return direction;
 }
 
-void firePlayerGunAt(int x, int y, int vx, int vy){
-  currentPlayerBullet = (currentPlayerBullet + 1) % MAX_PLAYER_BULLETS;
-  fireBullet(&playerBullets[currentPlayerBullet], x, y, vx, vy);
+// From the creep's gun to the middle of the ship
+int directionToShip(Creep* creep){
+  int dx = shipBounds.origin.x + shipBounds.size.w / 2 - (creep->bounds.origin.x + creep->bounds.size.w / 2);
+  int dy = shipBounds.origin.y + shipBounds.size.h / 2 - (creep->bounds.origin.y + creep->bounds.size.h);
+  return directionTo(dx, dy);
 }
 
-void fireCreepGun(Creep* creep, int vx, int vy){
-  currentCreepBullet = (currentCreepBullet + 1) % MAX_CREEP_BULLETS;
-  fireBullet(
-    &creepBullets[currentCreepBullet], 
-    creep->bounds.origin.x + creep->bounds.size.w / 2,
-    creep->bounds.origin.y + creep->bounds.size.h,
-    vx,
-    vy
+void fireCreepGun(Creep* creep, int direction){
+  GPoint velocity = directions[(direction + DIRECTION_COUNT) % DIRECTION_COUNT];
+  bulletPoolAdd(
+    &creepBullets,
+    TO_FIXED(creep->bounds.origin.x + creep->bounds.size.w / 2),
+    TO_FIXED(creep->bounds.origin.y + creep->bounds.size.h),
+    velocity.x * BULLET_SPEED / FIXED_ONE,
+    velocity.y * BULLET_SPEED / FIXED_ONE
   );
 }
 
+void fireCreepPattern(Creep* creep){
+  switch(creepSprites[creep->type].firePattern){
+    case FIRE_AIMED:
+      fireCreepGun(creep, directionToShip(creep));
+      break;
+    case FIRE_SPREAD:
+      for(int i = -1; i <= 1; i++) fireCreepGun(creep, DIRECTION_DOWN + i * SPREAD_STEP);
+      break;
+    case FIRE_RING:
+      for(int i = 0; i < DIRECTION_COUNT; i += RING_STEP) fireCreepGun(creep, i);
+      break;
+    default:
+      fireCreepGun(creep, DIRECTION_DOWN);
+  }
+}
+
 void firePlayerGun(){
   bool isTriple = gunType == TRIPLE_GUN;
   bool isDouble = gunType == DOUBLE_GUN;
@@ -215,18 +996,18 @@ void firePlayerGun(){
   int x = shipBounds.origin.x + ship->bounds.size.w / 2;
 
   if(isDefault){
-    firePlayerGunAt(x, bottom, 0, -1);
+    firePlayerGunAt(x, bottom, 0, -BULLET_SPEED);
   }
   
   if(isDouble){
-    firePlayerGunAt(x - 2, bottom, 0, -1);
-    firePlayerGunAt(x + 2, bottom, 0, -1);
+    firePlayerGunAt(x - 2, bottom, 0, -BULLET_SPEED);
+    firePlayerGunAt(x + 2, bottom, 0, -BULLET_SPEED);
   }
   
   if(isTriple){
-    firePlayerGunAt(x - 2, bottom, -1, -1);
-    firePlayerGunAt(x, bottom, 0, -1);
-    firePlayerGunAt(x + 2, bottom, 1, -1);
+    firePlayerGunAt(x - 2, bottom, -BULLET_SPEED, -BULLET_SPEED);
+    firePlayerGunAt(x, bottom, 0, -BULLET_SPEED);
+    firePlayerGunAt(x + 2, bottom, BULLET_SPEED, -BULLET_SPEED);
   }
 
   // Change this for gun speed power up
@@ -241,39 +1022,82 @@ bool isPlayerWeak(){
   return player.armor == 0;
 }
 
-void hideBullet(Bullet* bullet){
-  bullet->visible = false;
+void seedRandom(uint32_t seed){
+  randomState = seed ? seed : 1;
 }
 
+// xorshift32
+uint32_t nextRandom(){
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+// Uniform in low..high
+int randomRange(int low, int high){
+  return low + nextRandom() % (high - low + 1);
+}
+
+// Ticks until a creep fires again, CREEP_FIRE_INTERVAL on average
+int creepFireDelay(){
+  return randomRange(1, CREEP_FIRE_INTERVAL * 2 - 1);
+}
+
+void loadLevel(int index);
+
 Level* getCurrentLevel(){
-  return &game.levels[game.currentLevel % game.levelCount];  
+  int index = game.currentLevel % game.levelCount;
+  if(index != game.loadedLevel) loadLevel(index);
+  return &game.level;
 }
 
+void placeFormationAtTick(Formation* formation, int tick);
+void placeFormationMember(Creep* creep);
+
 void resetCreepMovement(Creep* creep){
+  if(creep->formation){
+    placeFormationMember(creep);
+    return;
+  }
+  GPoint initialPosition = creep->spawn->initialPosition;
   creep->currentRule = 0;
   creep->traveled = 0;
-  creep->bounds.origin.x = creep->initialPosition.x;
-  creep->bounds.origin.y = creep->initialPosition.y; 
+  creep->x = TO_FIXED(initialPosition.x);
+  creep->y = TO_FIXED(initialPosition.y);
+  creep->bounds.origin.x = initialPosition.x;
+  creep->bounds.origin.y = initialPosition.y;
 }
 
 void resetLevel(){
   Level* level = getCurrentLevel();
-  creepsLeft = level->creepCount;
+  uint32_t seed = gameSeed + game.currentLevel * LEVEL_SEED_STEP;
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Level %d seed %u", game.currentLevel, (unsigned)seed);
+  seedRandom(seed);
+  for(int index = 0; index < level->formationCount; index++) placeFormationAtTick(&level->formations[index], 0);
   for(int index = 0; index < level->creepCount; index++){
     Creep* creep = &level->creeps[index];
     int creepHealthMultiplier = (game.currentLevel / game.levelCount) + 1;
-    creep->health = creep->fullHealth * creepHealthMultiplier;
+    // Kept in 16 bits, the endless loop would wrap it negative
+    creep->health = MIN(creep->spawn->fullHealth * creepHealthMultiplier, INT16_MAX);
+    creep->fireCountdown = creepFireDelay();
     resetCreepMovement(creep);
+    level->live[index] = index;
   }
-  forEachPlayerBullet(hideBullet);
-  forEachCreepBullet(hideBullet);
+  level->liveCount = level->creepCount;
+  bulletPoolClear(&playerBullets);
+  bulletPoolClear(&creepBullets);
   player.armor = player.fullArmor;
 }
 
 void handleLevelWin(){
+#ifdef PHOENIX_PROFILE
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Level %d won, %d loop overruns and %d skipped frames so far",
+    game.currentLevel, loopOverruns, skippedFrames);
+#endif
   creepScore += 10;
   storeSelection = 0;
-  game.state = StoreState;
+  setGameState(StoreState);
   game.currentLevel++;
   saveState();
 }
@@ -286,115 +1110,417 @@ bool isCreepWeak(Creep* creep){
   return creep->health == 1;
 }
 
-bool checkForCreepHit(Creep* creep){
-  for(int index = 0; index < MAX_PLAYER_BULLETS; index++){
-    Bullet* bullet = &playerBullets[index];
-    if(bullet->visible){
-      if(grect_contains_point(&creep->bounds, &bullet->pos)){
-        // Reset bullet on hit
-        bullet->visible = false;
-        // Hurt creep
-        creep->health -= currentGunPower;
-        if(!isCreepAlive(creep)){
-          // Creep killed
-          player.money += creepScore;
-          // Did we win the level?
-          if(--creepsLeft == 0) handleLevelWin();
+void killCreep(Level* level, int liveIndex){
+  level->live[liveIndex] = level->live[--level->liveCount];
+}
+
+// Lists the creeps with health left, after their state was replaced
+void rebuildLiveCreeps(Level* level){
+  level->liveCount = 0;
+  for(int index = 0; index < level->creepCount; index++)
+    if(isCreepAlive(&level->creeps[index])) level->live[level->liveCount++] = index;
+}
+
+void bulletGridInit(BulletGrid* grid, int capacity){
+  grid->columns = (windowBounds.size.w >> GRID_CELL_SHIFT) + 1;
+  grid->rows = (windowBounds.size.h >> GRID_CELL_SHIFT) + 1;
+  int cells = grid->columns * grid->rows;
+  grid->head = malloc(sizeof(int16_t) * (cells + capacity));
+  grid->next = grid->head + cells;
+  grid->hit = malloc(capacity);
+}
+
+void bulletGridDestroy(BulletGrid* grid){
+  free(grid->head);
+  free(grid->hit);
+  grid->head = grid->next = NULL;
+  grid->hit = NULL;
+}
+
+// Anything off screen is kept in the border cells
+int gridColumn(BulletGrid* grid, int x){
+  return x < 0 ? 0 : MIN(x >> GRID_CELL_SHIFT, grid->columns - 1);
+}
+
+int gridRow(BulletGrid* grid, int y){
+  return y < 0 ? 0 : MIN(y >> GRID_CELL_SHIFT, grid->rows - 1);
+}
+
+void bulletGridBuild(BulletGrid* grid, BulletPool* pool){
+  memset(grid->head, 0xff, sizeof(int16_t) * grid->columns * grid->rows);
+  for(int i = 0; i < pool->count; i++){
+    int cell = gridRow(grid, FROM_FIXED(pool->y[i])) * grid->columns + gridColumn(grid, FROM_FIXED(pool->x[i]));
+    grid->next[i] = grid->head[cell];
+    grid->head[cell] = i;
+    grid->hit[i] = false;
+  }
+}
+
+// Marks every bullet of the grid's pool inside bounds as hit, up to limit.
+// Returns how many were hit.
+// Bullets hit the black pixels of the sprite at bounds, the mask says
+// which those are
+int bulletGridHit(BulletGrid* grid, BulletPool* pool, GRect* bounds, const uint32_t* mask, int limit){
+  int hits = 0;
+  int left = gridColumn(grid, bounds->origin.x);
+  int right = gridColumn(grid, bounds->origin.x + bounds->size.w - 1);
+  int top = gridRow(grid, bounds->origin.y);
+  int bottom = gridRow(grid, bounds->origin.y + bounds->size.h - 1);
+  for(int row = top; row <= bottom; row++){
+    for(int column = left; column <= right; column++){
+      int index = grid->head[row * grid->columns + column];
+      for(; index != -1 && hits < limit; index = grid->next[index]){
+        if(grid->hit[index]) continue;
+        GPoint pos = bulletPosition(pool, index);
+        if(!grect_contains_point(bounds, &pos)) continue;
+        if((mask[pos.y - bounds->origin.y] >> (pos.x - bounds->origin.x)) & 1){
+          grid->hit[index] = true;
+          hits++;
         }
-        return true;
       }
     }
   }
-  return false;
+  return hits;
 }
 
-bool creepShouldFire(Creep* creep){
-  return creep->health > 0 && (rand() % 1000) < 10;
+// Hit bullets can only be dropped once the pass is over, removing them
+// during it would shuffle the indices chained in the grid
+void bulletGridRemoveHits(BulletGrid* grid, BulletPool* pool){
+  for(int i = pool->count - 1; i >= 0; i--)
+    if(grid->hit[i]) bulletPoolRemove(pool, i);
 }
 
-void handlePlayerHit(Bullet* bullet){
-  if(--player.armor == -1) game.state = GameOverState;
-  hideBullet(bullet);
+// Number of hits at the current gun power it takes to kill the creep
+int hitsToKill(Creep* creep){
+  return (creep->health + currentGunPower - 1) / currentGunPower;
 }
 
-void checkForPlayerHit(Bullet* bullet){
-  // Check if creep bullet hit our ship
-  if(bullet->visible && grect_contains_point(&shipBounds, &bullet->pos)){
-    handlePlayerHit(bullet);
+// Returns true when the creep was killed
+bool checkForCreepHit(Creep* creep){
+  // Every bullet overlapping the creep lands this tick, until it dies
+  int hits = bulletGridHit(&bulletGrid, &playerBullets, &creep->bounds, creepSprites[creep->type].mask,
+    hitsToKill(creep));
+  if(hits == 0) return false;
+  // Hurt creep, redraw in case it turned weak
+  creep->health -= currentGunPower * hits;
+  markDirty(spriteRect(creep->bounds));
+  if(isCreepAlive(creep)) return false;
+  player.money += creepScore;
+  return true;
+}
+
+void checkForCreepHits(){
+  Level* level = getCurrentLevel();
+  bool killed = false;
+  bulletGridBuild(&bulletGrid, &playerBullets);
+  // Backwards, a kill moves the last live creep into the freed slot
+  for(int i = level->liveCount - 1; i >= 0; i--){
+    if(checkForCreepHit(&level->creeps[level->live[i]])){
+      killCreep(level, i);
+      killed = true;
+    }
   }
+  bulletGridRemoveHits(&bulletGrid, &playerBullets);
+  // Did we win the level?
+  if(killed && level->liveCount == 0) handleLevelWin();
+}
+
+bool creepShouldFire(Creep* creep){
+  if(--creep->fireCountdown > 0) return false;
+  creep->fireCountdown = creepFireDelay();
+  return true;
+}
+
+void handlePlayerHit(){
+  markDirty(armorBarRect());
+  markDirty(spriteRect(shipBounds));
+  if(--player.armor == -1) setGameState(GameOverState);
+}
+
+void checkForPlayerHits(){
+  // Check if creep bullets hit our ship
+  bulletGridBuild(&bulletGrid, &creepBullets);
+  int hits = bulletGridHit(&bulletGrid, &creepBullets, &shipBounds, shipMask, creepBullets.count);
+  for(int i = 0; i < hits && game.state == LevelState; i++) handlePlayerHit();
+  bulletGridRemoveHits(&bulletGrid, &creepBullets);
 }
 
 bool creepOutsideBounds(Creep* creep){
-  MovementRule* rule = &creep->rules[creep->currentRule];
+  MovementRule* rule = &creep->spawn->rules[creep->currentRule];
   int cx = creep->bounds.origin.x;
   int cy = creep->bounds.origin.y;
-  return (ABS(rule->delta.x) > 0 && (cx <= leftWall || cx >= rightWall)) ||
-    (ABS(rule->delta.y) > 0 && (cy <= topWall || cy >= bottomWall));
+  return (rule->dx != 0 && (cx <= leftWall || cx >= rightWall)) ||
+    (rule->dy != 0 && (cy <= topWall || cy >= bottomWall));
 }
 
-void updateCreepMovement(Creep* creep){
-  MovementRule* rule = &creep->rules[creep->currentRule];
-  creep->bounds.origin.x += rule->delta.x;
-  creep->bounds.origin.y += rule->delta.y;
-  creep->traveled += ABS(rule->delta.x) + ABS(rule->delta.y);
+// Runs the movement rules for one tick. Returns true when the creep moved
+// on to its next rule or was reset.
+bool stepCreepRules(Creep* creep){
+  MovementRule* rule = &creep->spawn->rules[creep->currentRule];
+  bool changed = false;
+  creep->x += rule->dx;
+  creep->y += rule->dy;
+  creep->bounds.origin.x = FROM_FIXED(creep->x);
+  creep->bounds.origin.y = FROM_FIXED(creep->y);
+  creep->traveled += ABS(rule->dx) + ABS(rule->dy);
   bool outsideWall = rule->conditionType == WALL && creepOutsideBounds(creep);
-  bool atDistance = rule->conditionType == DISTANCE && creep->traveled > rule->distance;
+  bool atDistance = rule->conditionType == DISTANCE && creep->traveled > TO_FIXED(rule->distance);
   // Cycle to next rule if needed
   if(outsideWall || atDistance){
-    creep->currentRule = (creep->currentRule + 1) % creep->ruleCount;
+    creep->currentRule = (creep->currentRule + 1) % creep->spawn->ruleCount;
     creep->traveled = 0;
+    changed = true;
   }
   // check if we need a reset
   if(creep->bounds.origin.y > windowBounds.size.h){
     resetCreepMovement(creep);
+    changed = true;
+  }
+  return changed;
+}
+
+// Finds a segment starting at the same position and rule, the creep
+// repeats itself from there on
+int findTrajectoryLoop(TrajectorySegment* segments, uint8_t* rules, int count, Fixed x, Fixed y, int rule){
+  for(int i = 0; i < count; i++)
+    if(segments[i].x == x && segments[i].y == y && rules[i] == rule) return i;
+  return -1;
+}
+
+// Unrolls the creep's rules from its initial position until they repeat,
+// building the table straight in the arena's free space without claiming
+// it. Returns NULL if they don't within the table limits or the space
+// left, the creep then keeps running its rules every tick.
+Trajectory* compileTrajectory(Creep* creep, Arena* arena){
+  size_t header = arenaAlign(sizeof(Trajectory));
+  if(arenaRemaining(arena) < header + sizeof(TrajectorySegment)) return NULL;
+  int maxSegments = (arenaRemaining(arena) - header) / sizeof(TrajectorySegment);
+  maxSegments = MIN(maxSegments, MAX_TRAJECTORY_SEGMENTS);
+  Trajectory* trajectory = arenaTail(arena);
+  TrajectorySegment* segments = (TrajectorySegment*)((uint8_t*)trajectory + header);
+  uint8_t rules[MAX_TRAJECTORY_SEGMENTS];
+  Creep sim = *creep;
+  sim.formation = NULL;
+  resetCreepMovement(&sim);
+  Fixed originX = sim.x;
+  Fixed originY = sim.y;
+
+  int count = 1;
+  int loop = -1;
+  segments[0] = (TrajectorySegment){ 0, 0, 0, 0, 0, 0 };
+  rules[0] = 0;
+  for(int tick = 1; tick <= MAX_TRAJECTORY_TICKS && loop == -1; tick++){
+    TrajectorySegment* segment = &segments[count - 1];
+    MovementRule* rule = &sim.spawn->rules[sim.currentRule];
+    segment->dx = rule->dx;
+    segment->dy = rule->dy;
+    segment->ticks++;
+    if(!stepCreepRules(&sim)) continue;
+    loop = findTrajectoryLoop(segments, rules, count, sim.x - originX, sim.y - originY, sim.currentRule);
+    if(loop == -1){
+      if(count == maxSegments) break;
+      segments[count] = (TrajectorySegment){ 0, 0, sim.x - originX, sim.y - originY, 0, tick };
+      rules[count++] = sim.currentRule;
+    }
+  }
+
+  if(loop == -1) return NULL;
+  // The table needs this much room to be built, even if it isn't kept
+  arena->highWater = MAX(arena->highWater, arena->used + header + sizeof(TrajectorySegment) * count);
+  trajectory->segments = segments;
+  trajectory->segmentCount = count;
+  trajectory->loopSegment = loop;
+  trajectory->length = segments[count - 1].startTick + segments[count - 1].ticks;
+  trajectory->period = trajectory->length - segments[loop].startTick;
+  return trajectory;
+}
+
+bool sameTrajectory(Trajectory* a, Trajectory* b){
+  return a->segmentCount == b->segmentCount && a->loopSegment == b->loopSegment &&
+    memcmp(a->segments, b->segments, sizeof(TrajectorySegment) * a->segmentCount) == 0;
+}
+
+// Puts the creep in the formation that moves exactly like it, starting a
+// new one if there's none yet. Only a new formation claims the space its
+// table was built in. NULL when the creep has to run its rules.
+Formation* joinFormation(Level* level, Creep* creep, Arena* arena){
+  Trajectory* trajectory = compileTrajectory(creep, arena);
+  if(trajectory == NULL) return NULL;
+  for(int i = 0; i < level->formationCount; i++){
+    Formation* formation = &level->formations[i];
+    if(formation->rules == creep->spawn->rules && sameTrajectory(formation->trajectory, trajectory))
+      return formation;
   }
+  arenaAlloc(arena, arenaAlign(sizeof(Trajectory)) + sizeof(TrajectorySegment) * trajectory->segmentCount);
+  Formation* formation = &level->formations[level->formationCount++];
+  formation->trajectory = trajectory;
+  formation->rules = creep->spawn->rules;
+  placeFormationAtTick(formation, 0);
+  return formation;
 }
 
+void placeFormation(Formation* formation, int segmentIndex, int segmentTick){
+  TrajectorySegment* segment = &formation->trajectory->segments[segmentIndex];
+  formation->segment = segmentIndex;
+  formation->segmentTick = segmentTick;
+  formation->x = segment->x + segment->dx * segmentTick;
+  formation->y = segment->y + segment->dy * segmentTick;
+}
+
+// Puts the formation where it would be after this many ticks since its
+// reset
+void placeFormationAtTick(Formation* formation, int tick){
+  Trajectory* trajectory = formation->trajectory;
+  if(tick >= trajectory->length){
+    int loopTick = trajectory->segments[trajectory->loopSegment].startTick;
+    tick = loopTick + (tick - loopTick) % trajectory->period;
+  }
+  // Binary search for the segment holding this tick
+  int low = 0;
+  int high = trajectory->segmentCount - 1;
+  while(low < high){
+    int mid = (low + high + 1) / 2;
+    if(trajectory->segments[mid].startTick <= tick) low = mid;
+    else high = mid - 1;
+  }
+  placeFormation(formation, low, tick - trajectory->segments[low].startTick);
+}
+
+void stepFormation(Formation* formation){
+  Trajectory* trajectory = formation->trajectory;
+  TrajectorySegment* segment = &trajectory->segments[formation->segment];
+  if(++formation->segmentTick < segment->ticks){
+    formation->x += segment->dx;
+    formation->y += segment->dy;
+    return;
+  }
+  int next = formation->segment + 1;
+  placeFormation(formation, next == trajectory->segmentCount ? trajectory->loopSegment : next, 0);
+}
+
+void placeFormationMember(Creep* creep){
+  creep->x = TO_FIXED(creep->spawn->initialPosition.x) + creep->formation->x;
+  creep->y = TO_FIXED(creep->spawn->initialPosition.y) + creep->formation->y;
+  creep->bounds.origin.x = FROM_FIXED(creep->x);
+  creep->bounds.origin.y = FROM_FIXED(creep->y);
+}
+
+void updateCreepMovement(Creep* creep){
+  markDirty(spriteRect(creep->bounds));
+  if(creep->formation) placeFormationMember(creep);
+  else stepCreepRules(creep);
+  markDirty(spriteRect(creep->bounds));
+}
+
+// Formations move first, their live members then just follow
 void updateCreeps(){
   Level* level = getCurrentLevel();
-  for(int index = 0; index < level->creepCount; index++){
-    Creep* creep = &level->creeps[index];
-    if(isCreepAlive(creep)){
-      updateCreepMovement(creep);
-      checkForCreepHit(creep);
-      if(creepShouldFire(creep)) fireCreepGun(creep, 0, 1);
-    }
+  for(int i = 0; i < level->formationCount; i++) stepFormation(&level->formations[i]);
+  for(int i = 0; i < level->liveCount; i++){
+    Creep* creep = &level->creeps[level->live[i]];
+    updateCreepMovement(creep);
+    if(creepShouldFire(creep)) fireCreepPattern(creep);
+  }
+}
+
+void buildWeakRows(){
+  memset(weakRows, 0, sizeof(weakRows));
+  for(int i = 0; i < 10; i++) weakRows[weakPoints[i].y] |= 1u << weakPoints[i].x;
+}
+
+// Bullets and weak markers are a few pixels each, cheaper to write
+// straight into the frame buffer than to draw one graphics call at a
+// time. Returns false when the buffer can't be written a word at a time.
+bool captureFrameBuffer(GContext* ctx, FrameBuffer* frame){
+  GBitmap* bitmap = graphics_capture_frame_buffer(ctx);
+  if(!bitmap) return false;
+  if(bitmap->row_size_bytes % 4 != 0 || (uintptr_t)bitmap->addr % 4 != 0 ||
+      bitmap->row_size_bytes * 8 < windowBounds.size.w || bitmap->bounds.size.h < windowBounds.size.h){
+    graphics_release_frame_buffer(ctx, bitmap);
+    return false;
   }
+  frame->bitmap = bitmap;
+  frame->words = bitmap->addr;
+  frame->wordsPerRow = bitmap->row_size_bytes / 4;
+  // The status bar sits above the window
+  frame->top = bitmap->bounds.size.h - windowBounds.size.h;
+  return true;
 }
 
-void drawPlayerBullets(GContext* ctx){
-  for(int i = 0; i < MAX_PLAYER_BULLETS; i++)
-    if(playerBullets[i].visible)
-      graphics_fill_circle(ctx, playerBullets[i].pos, BULLET_RADIUS);
+// Writes rows of a pattern less than 32 pixels wide, clipped to the
+// window, with one or two word writes per row
+void stamp(FrameBuffer* frame, int x, int y, const uint32_t* rows, int height, int width, bool white){
+  if(x <= -width || x >= windowBounds.size.w) return;
+  int left = MAX(x, 0);
+  int shift = left & 31;
+  uint32_t clip = (1u << MIN(width, windowBounds.size.w - x)) - 1;
+  for(int row = MAX(0, -y); row < height && y + row < windowBounds.size.h; row++){
+    uint32_t bits = (rows[row] & clip) >> (left - x);
+    uint32_t low = bits << shift;
+    uint32_t high = shift ? bits >> (32 - shift) : 0;
+    uint32_t* word = frame->words + (frame->top + y + row) * frame->wordsPerRow + (left >> 5);
+    if(white){
+      word[0] |= low;
+      if(high) word[1] |= high;
+    }else{
+      word[0] &= ~low;
+      if(high) word[1] &= ~high;
+    }
+  }
 }
 
-void drawCreepBullets(GContext* ctx){
-  for(int i = 0; i < MAX_CREEP_BULLETS; i++)
-    if(creepBullets[i].visible)
-      graphics_fill_circle(ctx, creepBullets[i].pos, BULLET_RADIUS);
+// Without a frame buffer, frame is NULL and the graphics calls draw
+void drawBullets(GContext* ctx, FrameBuffer* frame, BulletPool* pool){
+  for(int i = 0; i < pool->count; i++){
+    GPoint pos = bulletPosition(pool, i);
+    if(!isDirty(bulletRect(pos))) continue;
+    if(frame) stamp(frame, pos.x - 1, pos.y - 1, bulletRows, BULLET_STAMP_SIZE, BULLET_STAMP_SIZE, false);
+    else graphics_fill_rect(ctx, GRect(pos.x - 1, pos.y - 1, BULLET_STAMP_SIZE, BULLET_STAMP_SIZE), 0, GCornerNone);
+  }
 }
 
-void drawWeak(GContext* ctx, GPoint origin){
+void drawWeak(GContext* ctx, FrameBuffer* frame, GPoint origin){
+  if(frame){
+    stamp(frame, origin.x, origin.y, weakRows, WEAK_ROWS, WEAK_WIDTH, true);
+    return;
+  }
   graphics_context_set_stroke_color(ctx, GColorWhite);
   for(int i = 0; i < 10; i++)
     graphics_draw_pixel(ctx, GPoint(origin.x + weakPoints[i].x, origin.y + weakPoints[i].y));
 }
 
+void drawWeakMarkers(GContext* ctx, FrameBuffer* frame){
+  if(isPlayerWeak() && isDirty(spriteRect(shipBounds))) drawWeak(ctx, frame, shipBounds.origin);
+  Level* level = getCurrentLevel();
+  for(int i = 0; i < level->liveCount; i++){
+    Creep* creep = &level->creeps[level->live[i]];
+    if(isCreepWeak(creep) && isDirty(spriteRect(creep->bounds))) drawWeak(ctx, frame, creep->bounds.origin);
+  }
+}
+
+// Drawn over the sprites, after every other graphics call of the frame
+void drawMarks(GContext* ctx){
+  FrameBuffer frame;
+  FrameBuffer* target = captureFrameBuffer(ctx, &frame) ? &frame : NULL;
+  drawBullets(ctx, target, &playerBullets);
+  drawBullets(ctx, target, &creepBullets);
+  drawWeakMarkers(ctx, target);
+  if(target) graphics_release_frame_buffer(ctx, frame.bitmap);
+}
+
 void drawCreeps(GContext* ctx){
   Level* level = getCurrentLevel();
-  for(int index = 0; index < level->creepCount; index++){
-    Creep* creep = &level->creeps[index];
-    if(isCreepAlive(creep)){
-      graphics_draw_bitmap_in_rect(ctx, creepBitmap[creep->type], creep->bounds);
-      if(isCreepWeak(creep)) drawWeak(ctx, creep->bounds.origin);
-    }
+  for(int i = 0; i < level->liveCount; i++){
+    Creep* creep = &level->creeps[level->live[i]];
+    if(isDirty(spriteRect(creep->bounds)))
+      graphics_draw_bitmap_in_rect(ctx, creepSprites[creep->type].bitmap, creep->bounds);
   }
 }
 
 void drawText(GContext* ctx, const char* text, GRect rect){
   graphics_draw_text(ctx,
     text,
-    fonts_get_system_font(FONT_KEY_GOTHIC_14),
+    textFont,
     rect,
     GTextOverflowModeWordWrap,
     GTextAlignmentLeft,
@@ -405,7 +1531,7 @@ void drawText(GContext* ctx, const char* text, GRect rect){
 void drawBoldText(GContext* ctx, const char* text, GRect rect){
   graphics_draw_text(ctx,
     text,
-    fonts_get_system_font(FONT_KEY_GOTHIC_14_BOLD),
+    boldTextFont,
     rect,
     GTextOverflowModeWordWrap,
     GTextAlignmentLeft,
@@ -413,136 +1539,264 @@ void drawBoldText(GContext* ctx, const char* text, GRect rect){
   );
 }
 
-void drawScoreAndLevel(GContext* ctx){
-  snprintf(moneyText, 12, "$%d", player.money);
-  snprintf(levelText, 12, "Lvl %d", game.currentLevel + 1);
-  drawText(ctx, levelText, GRect(2, 2, 64, 8));
-  int x = 16;
-  if(player.money > 9) x += 8;
-  if(player.money > 99) x += 8;
-  if(player.money > 999) x += 8;
-  drawText(ctx, moneyText, GRect(windowBounds.size.w - x, 2, 48, 8));
-  if(game.state == GameOverState){
-    drawBoldText(ctx, "Press select to play again", GRect(16, 32, 128, 32));
+// Text layers keep their layout, so only rebuild the strings when the
+// values change. The frame that shows them is asked for, the playfield
+// needn't be repainted for it.
+void updateHud(){
+  if(player.money != hudMoney){
+    hudMoney = player.money;
+    snprintf(moneyText, sizeof(moneyText), "$%d", player.money);
+    text_layer_set_text(moneyTextLayer, moneyText);
+    redrawRequested = true;
+  }
+  if(game.currentLevel != hudLevel){
+    hudLevel = game.currentLevel;
+    snprintf(levelText, sizeof(levelText), "Lvl %d", game.currentLevel + 1);
+    text_layer_set_text(levelTextLayer, levelText);
+    redrawRequested = true;
   }
 }
 
+void drawGameOver(GContext* ctx){
+  drawBoldText(ctx, "Press select to play again", GRect(16, 32, 128, 32));
+}
+
 void drawGetReady(GContext* ctx){
+  if(!isDirty(readyTextRect())) return;
   snprintf(readyText, 4, "%d!", readyCount);
-  drawBoldText(ctx, readyText, GRect(
-    windowBounds.size.w / 2,
-    windowBounds.size.h / 2,
-    16,
-    16
-  ));
+  drawBoldText(ctx, readyText, readyTextRect());
 }
 
-void drawStore(GContext* ctx){
-  
-  int y = 32;
+bool isStoreRowSoldOut(int row){
+  switch(row){
+    case ARMOR_SELECTION: return player.fullArmor == MAX_ARMOR;
+    case POWER_UP_SELECTION: return currentGunPower == MAX_POWER;
+    case DOUBLE_GUN_SELECTION: return gunType == DOUBLE_GUN;
+    case TRIPLE_GUN_SELECTION: return gunType == TRIPLE_GUN;
+  }
+  return false;
+}
+
+// Repaints the row with the next frame
+void markStoreRowDirty(int row){
+  storeDirty |= 1 << row;
+  redrawRequested = true;
+  layer_mark_dirty(storeRows[row]);
+}
+
+void store_update_callback(Layer *me, GContext* ctx) {
+  if(!(storeDirty & STORE_TITLE_DIRTY)) return;
+  storeDirty &= ~STORE_TITLE_DIRTY;
+  graphics_context_set_text_color(ctx, GColorBlack);
+  drawBoldText(ctx, "Store", GRect(2, 0, 64, STORE_ROW_HEIGHT));
+}
+
+// Each row is its own layer so moving the selection or buying something
+// only repaints the rows involved
+void store_row_update_callback(Layer *me, GContext* ctx) {
+  int row = *(int*)layer_get_data(me);
+  if(!(storeDirty & (1 << row))) return;
+  storeDirty &= ~(1 << row);
+  GRect bounds = layer_get_bounds(me);
   int left = 16;
-  int right = windowBounds.size.w - 32;
+  int right = bounds.size.w - 32;
+  int farRight = bounds.size.w - padding / 2;
   int lineHeight = 8;
-  int farRight = windowBounds.size.w - padding / 2;
 
-  drawBoldText(ctx, "Store", GRect(2, 16, 64, lineHeight));
+  graphics_context_set_fill_color(ctx, GColorWhite);
+  graphics_fill_rect(ctx, bounds, 0, GCornerNone);
+  graphics_context_set_text_color(ctx, GColorBlack);
+  graphics_context_set_stroke_color(ctx, GColorBlack);
 
   // Current selection
-  drawText(ctx, ">", GRect(2, 30 + (lineHeight * 2 * storeSelection), 8, lineHeight));
+  if(row == storeSelection) drawText(ctx, ">", GRect(2, 0, 8, lineHeight));
 
-  drawText(ctx, "Armor", GRect(left, y, 64, lineHeight));
-  drawText(ctx, "$100", GRect(right, y, 32, lineHeight));
-  if(player.fullArmor == MAX_ARMOR){
-    graphics_draw_line(ctx, GPoint(left, y + lineHeight + 1), GPoint(farRight, y + lineHeight + 1));
+  drawText(ctx, storeLabels[row], GRect(left, 2, 64, lineHeight));
+  if(storePrices[row]) drawText(ctx, storePrices[row], GRect(right, 2, 32, lineHeight));
+  if(isStoreRowSoldOut(row)){
+    graphics_draw_line(ctx, GPoint(left, 2 + lineHeight + 1), GPoint(farRight, 2 + lineHeight + 1));
   }
+}
 
-  y += lineHeight * 2;
-
-  drawText(ctx, "Power Up", GRect(left, y, 64, lineHeight));
-  drawText(ctx, "$200", GRect(right, y, 32, lineHeight));
-  if(currentGunPower == MAX_POWER){
-    graphics_draw_line(ctx, GPoint(left, y + lineHeight + 1), GPoint(farRight, y + lineHeight + 1));
-  }
-
-  y += lineHeight * 2;
-
-  drawText(ctx, "Double Gun", GRect(left, y, 64, lineHeight));
-  drawText(ctx, "$300", GRect(right, y, 32, lineHeight));
-  if(gunType == DOUBLE_GUN){
-    graphics_draw_line(ctx, GPoint(left, y + lineHeight + 1), GPoint(farRight, y + lineHeight + 1));
-  }
+void drawShip(GContext* ctx) {
+  if(!isDirty(spriteRect(shipBounds))) return;
+  graphics_draw_bitmap_in_rect(ctx, ship, shipBounds);
+}
 
-  y += lineHeight * 2;
+void drawArmorBar(GContext* ctx) {
+  if(!isDirty(armorBarRect())) return;
+  int w = MAX(player.armor, 0) * windowBounds.size.w / player.fullArmor;
+  int h = ARMOR_BAR_HEIGHT;
+  graphics_fill_rect(ctx, GRect(0, windowBounds.size.h - h, w, h), 0, GCornerNone);
+}
 
-  drawText(ctx, "Triple Gun", GRect(left, y, 64, lineHeight));
-  drawText(ctx, "$500", GRect(right, y, 32, lineHeight));
-  if(gunType == TRIPLE_GUN){
-    graphics_draw_line(ctx, GPoint(left, y + lineHeight + 1), GPoint(farRight, y + lineHeight + 1));
+void requestRedraw(){
+  if(fullRedraw || dirtyRectCount > 0){
+    redrawRequested = true;
+    layer_mark_dirty(layer);
   }
+}
 
-  y += lineHeight * 2;
+void timer_callback(void *data);
+void ready_timer_callback(void *data);
 
-  drawText(ctx, "Done", GRect(left, y, 64, lineHeight));
+// Milliseconds since the epoch, wrapping. Only differences are used.
+// Positive when time is past the given time
+int32_t msPast(uint32_t now, uint32_t time){
+  return (int32_t)(now - time);
+}
 
+// Only the level needs a running loop, every other state sits idle
+// until a button or the count down wakes it up
+void scheduleTimers(){
+  if(gameLoopShouldRun()){
+    // A stopped loop starts over one step from now
+    if(timer == NULL){
+      nextStepTime = currentTimeMs() + ACCEL_STEP_MS;
+      timer = app_timer_register(ACCEL_STEP_MS, timer_callback, NULL);
+    }
+    // Samples come in batches, a handful of wakeups a second. Tilt from
+    // before a pause or the store is stale, start from level.
+    if(!accelSubscribed){
+      accelRing.head = 0;
+      accelRing.count = 0;
+      accelTilt = 0;
+      accel_data_service_subscribe(ACCEL_SAMPLES_PER_UPDATE, accel_data_handler);
+      accel_service_set_sampling_rate(ACCEL_SAMPLING_25HZ);
+      accelSubscribed = true;
+    }
+  }else{
+    if(timer != NULL){
+      app_timer_cancel(timer);
+      timer = NULL;
+    }
+    if(accelSubscribed){
+      accel_data_service_unsubscribe();
+      accelSubscribed = false;
+    }
+  }
+  if(game.state == GetReadyState){
+    if(readyTimer == NULL) readyTimer = app_timer_register(READY_STEP_MS, ready_timer_callback, NULL);
+  }else if(readyTimer != NULL){
+    app_timer_cancel(readyTimer);
+    readyTimer = NULL;
+  }
 }
 
-void drawShip(GContext* ctx) {
-  graphics_draw_bitmap_in_rect(ctx, ship, shipBounds);
-  if(isPlayerWeak()) drawWeak(ctx, shipBounds.origin);
+void scheduleGame(){
+  updateHud();
+  scheduleTimers();
+  requestRedraw();
 }
 
-void drawArmorBar(GContext* ctx) {
-  float ratio = (float)player.armor / (float)player.fullArmor;
-  int w = (int)(ratio * (float)windowBounds.size.w);
-  int h = 2;
-  graphics_fill_rect(ctx, GRect(0, windowBounds.size.h - h, w, h), 0, GCornerNone);
+// Count down, one second per step
+void ready_timer_callback(void *data) {
+  readyTimer = NULL;
+  markDirty(readyTextRect());
+  if(--readyCount == 0){
+    setGameState(LevelState);
+    readyCount = INITIAL_READY_COUNT;
+  }
+  scheduleGame();
 }
 
-void updateGetReady(){
-  if(--readyStepsLeft == 0){
-    if(--readyCount == 0){
-      game.state = LevelState;
-      readyCount = INITIAL_READY_COUNT;
-    }
-    readyStepsLeft = STEPS_IN_SECOND;
-  }  
+// One fixed step of the game
+void stepGame(){
+  PROFILE_START(lap);
+  gameTime++;
+  updateBullets(&playerBullets);
+  updateBullets(&creepBullets);
+  PROFILE_LAP(ProfileBullets, lap);
+  updateShipPosition();
+  PROFILE_LAP(ProfileShip, lap);
+  updateCreeps();
+  PROFILE_LAP(ProfileCreeps, lap);
+  checkForCreepHits();
+  checkForPlayerHits();
+  PROFILE_LAP(ProfileHits, lap);
+  if(playerGunReady()) firePlayerGun();
+  PROFILE_LAP(ProfileFire, lap);
+  PROFILE_SAMPLE(ProfileBulletCount, playerBullets.count + creepBullets.count);
+  // Not getCurrentLevel(), after a win that would load the next level
+  PROFILE_SAMPLE(ProfileCreepCount, game.level.liveCount);
+  PROFILE_HEAP(game.state);
 }
 
-// Game loop
+// Game loop, runs the steps due by now so the game keeps its speed
+// however long the steps and frames take
 void timer_callback(void *data) {
-  gameTime++;
-  if(game.state == LevelState && !isPaused){
-    forEachPlayerBullet(updateBullet);
-    forEachCreepBullet(updateBullet);
-    updateShipPosition();
-    updateCreeps();
-    forEachCreepBullet(checkForPlayerHit);
-    if(playerGunReady()) firePlayerGun();
+  timer = NULL;
+  uint32_t now = currentTimeMs();
+  int steps = 0;
+  while(gameLoopShouldRun() && msPast(now, nextStepTime) >= 0 && steps < MAX_CATCH_UP_STEPS){
+    stepGame();
+    nextStepTime += ACCEL_STEP_MS;
+    steps++;
   }
-  if(game.state == GetReadyState) updateGetReady();
-  // Redraw
-  layer_mark_dirty(layer);
-  // Ask for another loop
-  timer = app_timer_register(ACCEL_STEP_MS, timer_callback, NULL);
+  if(gameLoopShouldRun() && msPast(now, nextStepTime) >= 0){
+    // Too far behind to catch up, give up on the missed steps
+    loopOverruns++;
+    nextStepTime = now + ACCEL_STEP_MS;
+  }
+  PROFILE_DUMP_IF_DUE();
+  // Wake up at the next step, not a whole step after this one ended
+  if(gameLoopShouldRun()){
+    now = currentTimeMs();
+    int32_t delay = -msPast(now, nextStepTime);
+    timer = app_timer_register(MAX(delay, 1), timer_callback, NULL);
+  }
+  updateHud();
+  scheduleTimers();
+  // Still behind after stepping, leave drawing for when the loop catches up
+  bool behind = timer != NULL && msPast(currentTimeMs(), nextStepTime) >= 0;
+  if(behind && framesSkippedInRow < MAX_SKIPPED_FRAMES){
+    skippedFrames++;
+    framesSkippedInRow++;
+    return;
+  }
+  framesSkippedInRow = 0;
+  // Redraw only if something changed
+  requestRedraw();
 }
 
+void load_timer_callback(void *data);
+
 // Draw
 void layer_update_callback(Layer *me, GContext* ctx) {
+  PROFILE_START(lap);
+  // The system can ask for a redraw on its own, the frame buffer
+  // can't be trusted then
+  if(!redrawRequested) markAllDirty();
+  redrawRequested = false;
+  // Erase the changed regions, then paint whatever overlaps them
+  graphics_context_set_fill_color(ctx, GColorWhite);
+  if(fullRedraw){
+    graphics_fill_rect(ctx, windowBounds, 0, GCornerNone);
+  }else{
+    mergeDirtyRects();
+    for(int i = 0; i < dirtyRectCount; i++)
+      graphics_fill_rect(ctx, dirtyRects[i], 0, GCornerNone);
+  }
+  graphics_context_set_fill_color(ctx, GColorBlack);
   graphics_context_set_text_color(ctx, GColorBlack);
   if(game.state == TipState){
     graphics_draw_bitmap_in_rect(ctx, tipBitmap, tipBitmap->bounds);
     drawText(ctx, "Press any button...", GRect(28, windowBounds.size.h - 32, 128, 8));
   }else{
-    drawScoreAndLevel(ctx);
+    if(game.state == GameOverState) drawGameOver(ctx);
     if(game.state == LevelState || game.state == GetReadyState){
       drawShip(ctx);
       drawArmorBar(ctx);
-      drawPlayerBullets(ctx);
-      drawCreepBullets(ctx);
       drawCreeps(ctx);
+      drawMarks(ctx);
     }
     if(game.state == GetReadyState) drawGetReady(ctx);
-    if(game.state == StoreState) drawStore(ctx);
+  }
+  clearDirtyRects();
+  PROFILE_LAP(ProfileDraw, lap);
+  if(!gameLoadScheduled){
+    gameLoadScheduled = true;
+    app_timer_register(0, load_timer_callback, NULL);
   }
 }
 
@@ -571,18 +1825,19 @@ bool tryPurchaseSelection(){
 }
 
 void select_single_click_handler(ClickRecognizerRef recognizer, void *context) {
+  if(!gameLoaded) return;
   if(game.state == TipState){
-    game.state = GetReadyState;
+    setGameState(GetReadyState);
   }
   if(game.state == GameOverState){
     player.money = INITIAL_MONEY;
     player.armor = INITIAL_SHIP_ARMOR;
     game.currentLevel = 0;
-    game.state = GetReadyState;
     gunType = DEFAULT_GUN;
     currentGunPower = INITIAL_GUN_POWER;
     creepScore = CREEP_INITIAL_SCORE;
     resetLevel();
+    setGameState(GetReadyState);
   }
   if(game.state == LevelState){
     isPaused = !isPaused;
@@ -590,37 +1845,47 @@ void select_single_click_handler(ClickRecognizerRef recognizer, void *context) {
   if(game.state == StoreState){
     if(storeSelection == DONE_SELECTION){
       resetLevel();
-      game.state = GetReadyState;
+      setGameState(GetReadyState);
     }else{
       if(!tryPurchaseSelection()) vibes_short_pulse();
+      markStoreRowDirty(storeSelection);
     }
   }
+  scheduleGame();
 }
 
 void up_single_click_handler(ClickRecognizerRef recognizer, void *context) {
+  if(!gameLoaded) return;
   if(game.state == StoreState){
+    markStoreRowDirty(storeSelection);
     if(storeSelection == 0){
       storeSelection = 4;
     }else{
       storeSelection--;
     }
+    markStoreRowDirty(storeSelection);
   }
   if(game.state == TipState){
-    game.state = GetReadyState;
+    setGameState(GetReadyState);
   }
+  scheduleGame();
 }
 
 void down_single_click_handler(ClickRecognizerRef recognizer, void *context) {
+  if(!gameLoaded) return;
   if(game.state == StoreState){
+    markStoreRowDirty(storeSelection);
     if(storeSelection == 4){
       storeSelection = 0;
     }else{
       storeSelection++;
     }
+    markStoreRowDirty(storeSelection);
   }
   if(game.state == TipState){
-    game.state = GetReadyState;
+    setGameState(GetReadyState);
   }
+  scheduleGame();
 }
 
 void config_provider(void *context) {
@@ -630,100 +1895,496 @@ void config_provider(void *context) {
   window_single_click_subscribe(BUTTON_ID_UP, up_single_click_handler);
   window_set_click_context(BUTTON_ID_DOWN, context);
   window_single_click_subscribe(BUTTON_ID_DOWN, down_single_click_handler); 
+#ifdef PHOENIX_PROFILE
+  window_raw_click_subscribe(BUTTON_ID_UP, profile_button_down_handler, profile_button_up_handler, context);
+  window_raw_click_subscribe(BUTTON_ID_DOWN, profile_button_down_handler, profile_button_up_handler, context);
+#endif
 }
 
-int getBufferInt(uint8_t buffer[], int index){
-  int value = buffer[index];
-  return value > 128 ? value - 256 : value;
+ResHandle rulesHandle;
+
+size_t creepStorageSize(int creepCount){
+  return arenaAlign(sizeof(Creep) * creepCount) + arenaAlign(sizeof(CreepSpawn) * creepCount) +
+    arenaAlign(sizeof(uint16_t) * creepCount) + arenaAlign(sizeof(Formation) * creepCount);
 }
 
-void loadMovementRules() {
-  ResHandle handle = resource_get_handle(RESOURCE_ID_MOVEMENT_RULES);
-  size_t size = resource_size(handle);
-  uint8_t buffer[size];
-  resource_load(handle, buffer, size);
-  
-  int x, y, dx, dy;  
-  int levelIndex, creepIndex, ruleIndex, bufferIndex = 0;
+uint32_t fnv1a(uint32_t hash, const uint8_t* data, size_t size){
+  for(size_t i = 0; i < size; i++) hash = (hash ^ data[i]) * FNV_PRIME;
+  return hash;
+}
 
-  game.levelCount = buffer[bufferIndex++];
-  game.levels = malloc(sizeof(Level) * game.levelCount);
-  
-  for(levelIndex = 0; levelIndex < game.levelCount; levelIndex++){
-    Level level;
-    level.creepCount = buffer[bufferIndex++];
-    level.creeps = malloc(sizeof(Creep) * level.creepCount);
-    for(creepIndex = 0; creepIndex < level.creepCount; creepIndex++){
-      Creep creep;
-      creep.currentRule = 0;
-      creep.traveled = 0;
-      x = buffer[bufferIndex++];
-      y = buffer[bufferIndex++];
-      creep.fullHealth = buffer[bufferIndex++];
-      creep.health = creep.fullHealth;
-      creep.type = buffer[bufferIndex++];
-      creep.initialPosition = GPoint(x, y);
-      creep.bounds = GRect(x, y, creepBitmap[creep.type]->bounds.size.w, creepBitmap[creep.type]->bounds.size.h);
-      creep.ruleCount = buffer[bufferIndex++];
-      creep.rules = malloc(sizeof(MovementRule) * creep.ruleCount);
-      for(ruleIndex = 0; ruleIndex < creep.ruleCount; ruleIndex++){
-        MovementRule rule;
-        dx = getBufferInt(buffer, bufferIndex++);
-        dy = getBufferInt(buffer, bufferIndex++);
-        rule.delta = GPoint(dx, dy);
-        rule.conditionType = buffer[bufferIndex++];
-        rule.distance = buffer[bufferIndex++];
-        creep.rules[ruleIndex] = rule;
-      }
-      level.creeps[creepIndex] = creep;
-    }
-    game.levels[levelIndex] = level; 
+bool validateLevel(LevelRecord* record, size_t size){
+  if(size < sizeof(LevelRecord)) return false;
+  size_t expected = sizeof(LevelRecord) + sizeof(CreepRecord) * record->creepCount +
+    sizeof(MovementRule) * record->ruleCount;
+  if(record->creepCount == 0 || size != expected) return false;
+  CreepRecord* creeps = (CreepRecord*)(record + 1);
+  MovementRule* rules = (MovementRule*)(creeps + record->creepCount);
+  for(int i = 0; i < record->creepCount; i++){
+    CreepRecord* creep = &creeps[i];
+    if(creep->ruleCount == 0 || creep->firstRule + creep->ruleCount > record->ruleCount) return false;
+    if(creep->type >= creepTypeCount || creep->health == 0) return false;
   }
-  // i love you honey
+  for(int i = 0; i < record->ruleCount; i++){
+    MovementRule* rule = &rules[i];
+    if(rule->conditionType != WALL && rule->conditionType != DISTANCE) return false;
+    if(rule->dx == 0 && rule->dy == 0) return false;
+  }
+  return true;
 }
 
-void handle_init(void) {
-  
-  game.state = TipState;
-  game.currentLevel = 0;
+bool levelFileError(const char* reason){
+  APP_LOG(APP_LOG_LEVEL_ERROR, "Bad level file: %s", reason);
+  return false;
+}
 
-  player.armor = INITIAL_SHIP_ARMOR;
-  player.fullArmor = INITIAL_SHIP_ARMOR;
-  player.money = INITIAL_MONEY;
+bool spriteInAtlas(GRect rect){
+  GRect atlas = spriteAtlas->bounds;
+  return rect.size.w > 0 && rect.size.h > 0 && rect.origin.x >= 0 && rect.origin.y >= 0 &&
+    rect.origin.x + rect.size.w <= atlas.size.w && rect.origin.y + rect.size.h <= atlas.size.h;
+}
 
-  loadState();
+// Fills in the mask rows of the sprite at rect, returns where the next
+// sprite's rows go
+uint32_t* buildSpriteMask(uint32_t* mask, GRect rect){
+  uint8_t* pixels = spriteAtlas->addr;
+  for(int y = 0; y < rect.size.h; y++){
+    uint8_t* row = pixels + (rect.origin.y + y) * spriteAtlas->row_size_bytes;
+    mask[y] = 0;
+    for(int x = 0; x < rect.size.w; x++){
+      int atlasX = rect.origin.x + x;
+      if(!(row[atlasX / 8] & (1 << (atlasX % 8)))) mask[y] |= 1u << x;
+    }
+  }
+  return mask + rect.size.h;
+}
 
-  // Init Window
-  window = window_create();
-  window_stack_push(window, true);
+// Cuts the ship out of the atlas, notes where the creep sprites are and
+// builds the hit masks of them all
+bool createSprites(SpriteRecord* records, int count){
+  int maskRows = 0;
+  for(int i = 0; i < count; i++){
+    if(!spriteInAtlas(records[i].rect)) return levelFileError("sprite outside the atlas");
+    if(records[i].rect.size.w > MAX_SPRITE_WIDTH) return levelFileError("sprite too wide");
+    if(records[i].firePattern >= FIRE_PATTERN_COUNT) return levelFileError("unknown fire pattern");
+    maskRows += records[i].rect.size.h;
+  }
+  spriteMasks = malloc(sizeof(uint32_t) * maskRows);
+  ship = gbitmap_create_as_sub_bitmap(spriteAtlas, records[0].rect);
+  shipMask = spriteMasks;
+  uint32_t* mask = buildSpriteMask(shipMask, records[0].rect);
+  creepTypeCount = count - 1;
+  creepSprites = malloc(sizeof(Sprite) * creepTypeCount);
+  for(int type = 0; type < creepTypeCount; type++){
+    creepSprites[type].rect = records[type + 1].rect;
+    creepSprites[type].firePattern = records[type + 1].firePattern;
+    creepSprites[type].bitmap = NULL;
+    creepSprites[type].mask = mask;
+    creepSprites[type].references = 0;
+    mask = buildSpriteMask(mask, creepSprites[type].rect);
+  }
+  return true;
+}
 
-  // Init Canvas Layer
-  windowLayer = window_get_root_layer(window);
-  windowBounds = layer_get_frame(windowLayer);
-  layer = layer_create(windowBounds);
-  layer_set_update_proc(layer, layer_update_callback);
-  layer_add_child(windowLayer, layer);
+GBitmap* acquireCreepSprite(int type){
+  Sprite* sprite = &creepSprites[type];
+  if(sprite->references++ == 0) sprite->bitmap = gbitmap_create_as_sub_bitmap(spriteAtlas, sprite->rect);
+  return sprite->bitmap;
+}
 
-  // Load resources
-  ship = gbitmap_create_with_resource(RESOURCE_ID_PLAYER_SHIP_IMAGE);
-  creepBitmap[0] = gbitmap_create_with_resource(RESOURCE_ID_CREEP_1_IMAGE);
-  creepBitmap[1] = gbitmap_create_with_resource(RESOURCE_ID_CREEP_2_IMAGE);
-  creepBitmap[2] = gbitmap_create_with_resource(RESOURCE_ID_CREEP_3_IMAGE);
-  creepBitmap[3] = gbitmap_create_with_resource(RESOURCE_ID_CREEP_4_IMAGE);
-  tipBitmap = gbitmap_create_with_resource(RESOURCE_ID_TIP_IMAGE);
-  
-  loadMovementRules();
+void releaseCreepSprite(int type){
+  Sprite* sprite = &creepSprites[type];
+  if(--sprite->references == 0){
+    gbitmap_destroy(sprite->bitmap);
+    sprite->bitmap = NULL;
+  }
+}
+
+void destroySprites(){
+  for(int type = 0; type < creepTypeCount; type++)
+    if(creepSprites[type].bitmap) gbitmap_destroy(creepSprites[type].bitmap);
+  free(creepSprites);
+  creepSprites = NULL;
+  creepTypeCount = 0;
+  if(ship) gbitmap_destroy(ship);
+  ship = NULL;
+  free(spriteMasks);
+  spriteMasks = NULL;
+  shipMask = NULL;
+}
 
-  // Init walls
+// The walls depend on the ship's size, trajectories are compiled against
+// them
+void initWalls(){
   rightWall = windowBounds.size.w - padding - ship->bounds.size.w;
   leftWall = padding + ship->bounds.size.w;
   topWall = 20;
   bottomWall = 50;
   bottom = windowBounds.size.h - ship->bounds.size.h - padding;
+}
+
+// The arena room the level takes once loaded: its block, the creeps and
+// one table per formation, plus the room for building the last table.
+// The block is at the arena's tail, the tables are built past it the way
+// loadLevel builds them. Formations are told apart by a hash of their
+// rules and table.
+size_t levelArenaSize(LevelRecord* record, size_t size, Arena* arena){
+  CreepRecord* records = (CreepRecord*)(record + 1);
+  MovementRule* rules = (MovementRule*)(records + record->creepCount);
+  uint32_t* formations = arenaAlloc(arena, sizeof(uint32_t) * record->creepCount);
+  int formationCount = 0;
+  size_t used = arenaAlign(size) + creepStorageSize(record->creepCount);
+  size_t needed = used;
+  for(int i = 0; i < record->creepCount; i++){
+    CreepSpawn spawn;
+    spawn.initialPosition = GPoint(records[i].x, records[i].y);
+    spawn.rules = &rules[records[i].firstRule];
+    spawn.ruleCount = records[i].ruleCount;
+    Creep creep;
+    memset(&creep, 0, sizeof(creep));
+    creep.spawn = &spawn;
+    Trajectory* trajectory = compileTrajectory(&creep, arena);
+    if(trajectory == NULL) continue;
+    size_t tableSize = arenaAlign(sizeof(Trajectory)) + sizeof(TrajectorySegment) * trajectory->segmentCount;
+    needed = MAX(needed, used + tableSize);
+    uint32_t hash = fnv1a(FNV_OFFSET_BASIS, (uint8_t*)spawn.rules, sizeof(MovementRule) * spawn.ruleCount);
+    hash = fnv1a(hash, (uint8_t*)&trajectory->loopSegment, sizeof(trajectory->loopSegment));
+    hash = fnv1a(hash, (uint8_t*)trajectory->segments, sizeof(TrajectorySegment) * trajectory->segmentCount);
+    int formation = 0;
+    while(formation < formationCount && formations[formation] != hash) formation++;
+    if(formation < formationCount) continue;
+    formations[formationCount++] = hash;
+    used += arenaAlign(tableSize);
+  }
+  return MAX(needed, used);
+}
+
+// Reads the sprites and the level offsets, checks every level once and
+// sizes the level arena for the largest one so loading one later is just
+// a read
+bool loadLevelIndex(){
+  rulesHandle = resource_get_handle(RESOURCE_ID_MOVEMENT_RULES);
+  size_t fileSize = resource_size(rulesHandle);
+  LevelFileHeader header;
+  if(fileSize < sizeof(header)) return levelFileError("too small");
+  resource_load_byte_range(rulesHandle, 0, (uint8_t*)&header, sizeof(header));
+  if(memcmp(header.magic, "PHXL", 4) != 0) return levelFileError("wrong magic");
+  if(header.version != LEVEL_FILE_VERSION) return levelFileError("unsupported version");
+  if(header.size != fileSize || header.levelCount == 0 || header.spriteCount < 2) return levelFileError("bad header");
+
+  size_t tableSize = sizeof(uint32_t) * (header.levelCount + 1);
+  size_t spritesSize = sizeof(SpriteRecord) * header.spriteCount;
+  size_t dataStart = sizeof(header) + tableSize + spritesSize;
+  if(dataStart > fileSize) return levelFileError("truncated offsets");
+  game.levelOffsets = malloc(tableSize);
+  resource_load_byte_range(rulesHandle, sizeof(header), (uint8_t*)game.levelOffsets, tableSize);
+
+  SpriteRecord* sprites = malloc(spritesSize);
+  resource_load_byte_range(rulesHandle, sizeof(header) + tableSize, (uint8_t*)sprites, spritesSize);
+  uint32_t checksum = fnv1a(FNV_OFFSET_BASIS, (uint8_t*)sprites, spritesSize);
+  bool spritesCreated = createSprites(sprites, header.spriteCount);
+  free(sprites);
+  if(!spritesCreated) return false;
+  initWalls();
+  game.levelCount = header.levelCount;
+  game.loadedLevel = -1;
+  if(game.levelOffsets[0] != dataStart || game.levelOffsets[game.levelCount] != fileSize)
+    return levelFileError("offsets don't cover the file");
+
+  // The arena first holds one level block at a time to check it, with
+  // a hash per creep and room to build one table past it
+  size_t checkSize = 0;
+  for(int levelIndex = 0; levelIndex < game.levelCount; levelIndex++){
+    uint32_t start = game.levelOffsets[levelIndex];
+    uint32_t end = game.levelOffsets[levelIndex + 1];
+    if(end < start + sizeof(LevelRecord)) return levelFileError("level too small");
+    LevelRecord record;
+    resource_load_byte_range(rulesHandle, start, (uint8_t*)&record, sizeof(record));
+    checkSize = MAX(checkSize, arenaAlign(end - start) + arenaAlign(sizeof(uint32_t) * record.creepCount));
+  }
+  arenaInit(&game.levelArena, checkSize + arenaAlign(sizeof(Trajectory)) +
+    sizeof(TrajectorySegment) * MAX_TRAJECTORY_SEGMENTS);
+  if(game.levelArena.size == 0) return levelFileError("no room for the largest level");
+
+  size_t arenaSize = 0;
+  for(int levelIndex = 0; levelIndex < game.levelCount; levelIndex++){
+    size_t size = game.levelOffsets[levelIndex + 1] - game.levelOffsets[levelIndex];
+    arenaReset(&game.levelArena);
+    LevelRecord* record = arenaAlloc(&game.levelArena, size);
+    resource_load_byte_range(rulesHandle, game.levelOffsets[levelIndex], (uint8_t*)record, size);
+    checksum = fnv1a(checksum, (uint8_t*)record, size);
+    if(!validateLevel(record, size)) return levelFileError("invalid level");
+    arenaSize = MAX(arenaSize, levelArenaSize(record, size, &game.levelArena));
+  }
+  if(checksum != header.checksum) return levelFileError("checksum mismatch");
+  game.levelFileChecksum = checksum;
+  arenaDestroy(&game.levelArena);
+  arenaInit(&game.levelArena, arenaSize);
+  if(game.levelArena.size == 0) return levelFileError("no room for the largest level");
+  return true;
+}
+
+// Drops the loaded level and the sprites only it used
+void unloadLevel(){
+  if(game.loadedLevel < 0) return;
+  for(int index = 0; index < game.level.creepCount; index++) releaseCreepSprite(game.level.creeps[index].type);
+  game.level.creepCount = 0;
+  game.loadedLevel = -1;
+  arenaReset(&game.levelArena);
+}
+
+// Creeps with the same moves share the first copy of them, which also
+// tells joinFormation which formations to look at
+MovementRule* sharedRules(CreepSpawn* spawns, int count, MovementRule* rules, int ruleCount){
+  for(int i = 0; i < count; i++){
+    if(spawns[i].ruleCount != ruleCount) continue;
+    if(spawns[i].rules == rules || memcmp(spawns[i].rules, rules, sizeof(MovementRule) * ruleCount) == 0)
+      return spawns[i].rules;
+  }
+  return rules;
+}
+
+void loadLevel(int index) {
+  Arena* arena = &game.levelArena;
+  unloadLevel();
+  game.loadedLevel = index;
+
+  // The level block stays in the arena, creeps use its rules in place
+  size_t size = game.levelOffsets[index + 1] - game.levelOffsets[index];
+  LevelRecord* record = arenaAlloc(arena, size);
+  resource_load_byte_range(rulesHandle, game.levelOffsets[index], (uint8_t*)record, size);
+  CreepRecord* records = (CreepRecord*)(record + 1);
+  MovementRule* rules = (MovementRule*)(records + record->creepCount);
+
+  int creepIndex;
+  Level level;
+  level.creepCount = record->creepCount;
+  level.creeps = arenaAlloc(arena, sizeof(Creep) * level.creepCount);
+  level.spawns = arenaAlloc(arena, sizeof(CreepSpawn) * level.creepCount);
+  level.live = arenaAlloc(arena, sizeof(uint16_t) * level.creepCount);
+  level.formations = arenaAlloc(arena, sizeof(Formation) * level.creepCount);
+  level.formationCount = 0;
+  for(creepIndex = 0; creepIndex < level.creepCount; creepIndex++){
+    CreepRecord* creepRecord = &records[creepIndex];
+    CreepSpawn* spawn = &level.spawns[creepIndex];
+    spawn->initialPosition = GPoint(creepRecord->x, creepRecord->y);
+    spawn->ruleCount = creepRecord->ruleCount;
+    spawn->rules = sharedRules(level.spawns, creepIndex, &rules[creepRecord->firstRule], spawn->ruleCount);
+    spawn->fullHealth = creepRecord->health;
+
+    Creep* creep = &level.creeps[creepIndex];
+    creep->spawn = spawn;
+    creep->currentRule = 0;
+    creep->traveled = 0;
+    creep->fireCountdown = CREEP_FIRE_INTERVAL;
+    creep->formation = NULL;
+    creep->health = spawn->fullHealth;
+    creep->type = creepRecord->type;
+    GSize size = creepSprites[creep->type].rect.size;
+    creep->bounds = GRect(creepRecord->x, creepRecord->y, size.w, size.h);
+    acquireCreepSprite(creep->type);
+    level.live[creepIndex] = creepIndex;
+  }
+  level.liveCount = level.creepCount;
+  // Tables go after all the creeps so that one running out of room
+  // doesn't leave the rest without theirs
+  for(creepIndex = 0; creepIndex < level.creepCount; creepIndex++){
+    Creep* creep = &level.creeps[creepIndex];
+    creep->formation = joinFormation(&level, creep, arena);
+  }
+  game.level = level;
+#ifdef PHOENIX_PROFILE
+  APP_LOG(APP_LOG_LEVEL_DEBUG, "Level %d has %d creeps in %d formations, uses %d of %d arena bytes, high water %d",
+    index, level.creepCount, level.formationCount, (int)arena->used, (int)arena->size, (int)arena->highWater);
+#endif
+  // i love you honey
+}
+
+// Blobs longer than a persist value are spread over consecutive keys
+bool persistWriteBlob(uint32_t firstKey, const uint8_t* data, size_t size){
+  for(size_t offset = 0; offset < size; offset += PERSIST_DATA_MAX_LENGTH, firstKey++){
+    size_t chunk = MIN(size - offset, (size_t)PERSIST_DATA_MAX_LENGTH);
+    if(persist_write_data(firstKey, data + offset, chunk) != (int)chunk) return false;
+  }
+  return true;
+}
+
+bool persistReadBlob(uint32_t firstKey, uint8_t* data, size_t size){
+  for(size_t offset = 0; offset < size; offset += PERSIST_DATA_MAX_LENGTH, firstKey++){
+    size_t chunk = MIN(size - offset, (size_t)PERSIST_DATA_MAX_LENGTH);
+    if(persist_read_data(firstKey, data + offset, chunk) != (int)chunk) return false;
+  }
+  return true;
+}
+
+void deleteSnapshot(){
+  for(uint32_t key = SNAPSHOT_KEY; key < SNAPSHOT_KEY + SNAPSHOT_MAX_CHUNKS && persist_exists(key); key++)
+    persist_delete(key);
+}
+
+size_t snapshotSize(int creepCount, int bulletCount){
+  return sizeof(SnapshotHeader) + sizeof(CreepSnapshot) * creepCount + sizeof(BulletSnapshot) * bulletCount;
+}
+
+BulletSnapshot* snapshotBullets(BulletPool* pool, BulletSnapshot* snapshot){
+  for(int i = 0; i < pool->count; i++, snapshot++){
+    snapshot->x = pool->x[i];
+    snapshot->y = pool->y[i];
+    snapshot->vx = pool->vx[i];
+    snapshot->vy = pool->vy[i];
+  }
+  return snapshot;
+}
+
+BulletSnapshot* restoreBullets(BulletPool* pool, BulletSnapshot* snapshot, int count){
+  bulletPoolClear(pool);
+  for(int i = 0; i < count; i++, snapshot++)
+    bulletPoolAdd(pool, snapshot->x, snapshot->y, snapshot->vx, snapshot->vy);
+  return snapshot;
+}
+
+// Saves the level being played so the next launch resumes it. Levels too
+// big for the snapshot keys are played again from the start instead.
+void saveSnapshot(){
+  // Whatever was saved before is still waiting to be restored
+  if(!gameLoaded) return;
+  deleteSnapshot();
+  if(game.state != LevelState && game.state != GetReadyState) return;
+  Level* level = getCurrentLevel();
+  size_t size = snapshotSize(level->creepCount, playerBullets.count + creepBullets.count);
+  if(size > PERSIST_DATA_MAX_LENGTH * SNAPSHOT_MAX_CHUNKS) return;
+  uint8_t* data = malloc(size);
+  if(data == NULL) return;
+
+  SnapshotHeader* header = (SnapshotHeader*)data;
+  memset(header, 0, sizeof(SnapshotHeader));
+  header->version = SNAPSHOT_VERSION;
+  header->size = size;
+  header->levelFileChecksum = game.levelFileChecksum;
+  header->currentLevel = game.currentLevel;
+  header->creepCount = level->creepCount;
+  header->playerBulletCount = playerBullets.count;
+  header->creepBulletCount = creepBullets.count;
+  header->gameTime = gameTime;
+  header->shipX = shipX;
+  header->randomState = randomState;
+  header->armor = player.armor;
+  header->creepsLeft = level->liveCount;
+  header->lastPlayerFireTime = lastPlayerFireTime;
+
+  CreepSnapshot* creeps = (CreepSnapshot*)(header + 1);
+  for(int index = 0; index < level->creepCount; index++){
+    Creep* creep = &level->creeps[index];
+    CreepSnapshot* snapshot = &creeps[index];
+    snapshot->x = creep->x;
+    snapshot->y = creep->y;
+    snapshot->traveled = creep->traveled;
+    snapshot->health = creep->health;
+    snapshot->fireCountdown = creep->fireCountdown;
+    snapshot->currentRule = creep->currentRule;
+    snapshot->segment = creep->formation ? creep->formation->segment : 0;
+    snapshot->segmentTick = creep->formation ? creep->formation->segmentTick : 0;
+  }
+  BulletSnapshot* bullets = (BulletSnapshot*)(creeps + level->creepCount);
+  bullets = snapshotBullets(&playerBullets, bullets);
+  snapshotBullets(&creepBullets, bullets);
+
+  header->checksum = fnv1a(FNV_OFFSET_BASIS, (uint8_t*)(header + 1), size - sizeof(SnapshotHeader));
+  if(!persistWriteBlob(SNAPSHOT_KEY, data, size)) deleteSnapshot();
+  free(data);
+}
+
+bool creepSnapshotValid(Creep* creep, CreepSnapshot* snapshot){
+  if(creep->formation){
+    Trajectory* trajectory = creep->formation->trajectory;
+    return snapshot->segment < trajectory->segmentCount &&
+      snapshot->segmentTick < trajectory->segments[snapshot->segment].ticks;
+  }
+  return snapshot->currentRule < creep->spawn->ruleCount;
+}
+
+bool snapshotMatches(SnapshotHeader* header, Level* level){
+  return header->version == SNAPSHOT_VERSION && header->levelFileChecksum == game.levelFileChecksum &&
+    header->currentLevel == game.currentLevel && header->creepCount == level->creepCount &&
+    header->playerBulletCount <= playerBullets.capacity && header->creepBulletCount <= creepBullets.capacity &&
+    header->size == snapshotSize(header->creepCount, header->playerBulletCount + header->creepBulletCount);
+}
+
+bool snapshotValid(SnapshotHeader* header, uint8_t* data, Level* level){
+  if(fnv1a(FNV_OFFSET_BASIS, data + sizeof(SnapshotHeader), header->size - sizeof(SnapshotHeader)) != header->checksum)
+    return false;
+  CreepSnapshot* creeps = (CreepSnapshot*)(data + sizeof(SnapshotHeader));
+  int creepsLeft = 0;
+  for(int index = 0; index < level->creepCount; index++){
+    if(!creepSnapshotValid(&level->creeps[index], &creeps[index])) return false;
+    if(creeps[index].health > 0) creepsLeft++;
+  }
+  return creepsLeft > 0 && creepsLeft == header->creepsLeft;
+}
+
+void applySnapshot(SnapshotHeader* header, uint8_t* data, Level* level){
+  CreepSnapshot* creeps = (CreepSnapshot*)(data + sizeof(SnapshotHeader));
+  for(int index = 0; index < level->creepCount; index++){
+    Creep* creep = &level->creeps[index];
+    CreepSnapshot* snapshot = &creeps[index];
+    creep->x = snapshot->x;
+    creep->y = snapshot->y;
+    creep->traveled = snapshot->traveled;
+    creep->health = snapshot->health;
+    creep->fireCountdown = snapshot->fireCountdown;
+    creep->currentRule = snapshot->currentRule;
+    creep->bounds.origin.x = FROM_FIXED(creep->x);
+    creep->bounds.origin.y = FROM_FIXED(creep->y);
+    // Members were saved in lockstep, any of them places the formation
+    if(creep->formation) placeFormation(creep->formation, snapshot->segment, snapshot->segmentTick);
+  }
+  rebuildLiveCreeps(level);
+  BulletSnapshot* bullets = (BulletSnapshot*)(creeps + level->creepCount);
+  bullets = restoreBullets(&playerBullets, bullets, header->playerBulletCount);
+  restoreBullets(&creepBullets, bullets, header->creepBulletCount);
+
+  gameTime = header->gameTime;
+  shipX = MAX(MIN(header->shipX, TO_FIXED(rightWall)), TO_FIXED(padding));
+  shipBounds.origin.x = FROM_FIXED(shipX);
+  randomState = header->randomState;
+  player.armor = MIN(header->armor, player.fullArmor);
+  lastPlayerFireTime = header->lastPlayerFireTime;
+}
+
+// Puts the world back the way saveSnapshot found it, if the snapshot is
+// for the level the saved game is on. A snapshot is only used once.
+bool restoreSnapshot(){
+  SnapshotHeader header;
+  if(persist_read_data(SNAPSHOT_KEY, &header, sizeof(header)) != sizeof(header)) return false;
+  Level* level = getCurrentLevel();
+  uint8_t* data = snapshotMatches(&header, level) ? malloc(header.size) : NULL;
+  bool restored = data != NULL && persistReadBlob(SNAPSHOT_KEY, data, header.size) &&
+    snapshotValid(&header, data, level);
+  if(restored) applySnapshot(&header, data, level);
+  free(data);
+  deleteSnapshot();
+  return restored;
+}
+
+// Everything the game needs past the tip screen
+void loadGame(){
+  spriteAtlas = gbitmap_create_with_resource(RESOURCE_ID_SPRITES_IMAGE);
+
+  bulletPoolInit(&playerBullets, PLAYER_BULLET_CAPACITY);
+  bulletPoolInit(&creepBullets, CREEP_BULLET_CAPACITY);
+  bulletGridInit(&bulletGrid, MAX(PLAYER_BULLET_CAPACITY, CREEP_BULLET_CAPACITY));
+
+  // The sprites are described in the level file
+  if(!loadLevelIndex()){
+    // Nothing to play without levels
+    window_stack_pop_all(false);
+    return;
+  }
 
   app_log(APP_LOG_LEVEL_INFO, "main", 513, "Size (%d,%d) Left: %d, Right: %d", windowBounds.size.w, windowBounds.size.h, leftWall, rightWall);
 
   // Place ship in bottom center
+  shipX = TO_FIXED(windowBounds.size.w / 2 - ship->bounds.size.w / 2);
   shipBounds = GRect(
     windowBounds.size.w / 2 - ship->bounds.size.w / 2,
     bottom,
@@ -732,34 +2393,104 @@ void handle_init(void) {
   );
 
   resetLevel();
+  gameLoaded = true;
+  // Pick up a level left in the middle, after a count down
+  if(restoreSnapshot()) setGameState(GetReadyState);
+
+  scheduleGame();
+}
 
-  // Init accelerometer callback
-  accel_data_service_subscribe(0, NULL);
-  accel_service_set_sampling_rate(ACCEL_SAMPLING_10HZ);
+void load_timer_callback(void *data) {
+  loadGame();
+}
+
+void handle_init(void) {
+  
+  game.state = TipState;
+  game.currentLevel = 0;
+  game.loadedLevel = -1;
+  if(gameSeed == 0) gameSeed = time(NULL);
+
+  player.armor = INITIAL_SHIP_ARMOR;
+  player.fullArmor = INITIAL_SHIP_ARMOR;
+  player.money = INITIAL_MONEY;
+
+  loadState();
+  buildWeakRows();
+  PROFILE_RESET();
+
+  // Init Window
+  window = window_create();
+  // Keep the frame buffer between frames for dirty rect redraws
+  window_set_background_color(window, GColorClear);
+  window_stack_push(window, true);
+
+  // Init Canvas Layer
+  windowLayer = window_get_root_layer(window);
+  windowBounds = layer_get_frame(windowLayer);
+  layer = layer_create(windowBounds);
+  layer_set_update_proc(layer, layer_update_callback);
+  layer_add_child(windowLayer, layer);
+
+  textFont = fonts_get_system_font(FONT_KEY_GOTHIC_14);
+  boldTextFont = fonts_get_system_font(FONT_KEY_GOTHIC_14_BOLD);
+
+  // HUD on top of the playfield
+  hudLayer = layer_create(windowBounds);
+  levelTextLayer = text_layer_create(GRect(2, 2, 64, HUD_TEXT_HEIGHT));
+  moneyTextLayer = text_layer_create(GRect(windowBounds.size.w - 50, 2, 48, HUD_TEXT_HEIGHT));
+  text_layer_set_font(levelTextLayer, textFont);
+  text_layer_set_font(moneyTextLayer, textFont);
+  text_layer_set_text_alignment(moneyTextLayer, GTextAlignmentRight);
+  layer_add_child(hudLayer, text_layer_get_layer(levelTextLayer));
+  layer_add_child(hudLayer, text_layer_get_layer(moneyTextLayer));
+  layer_add_child(windowLayer, hudLayer);
+
+  // Store menu, one layer per row
+  storeLayer = layer_create(GRect(0, 16, windowBounds.size.w, windowBounds.size.h - 16));
+  layer_set_update_proc(storeLayer, store_update_callback);
+  for(int row = 0; row < STORE_ROW_COUNT; row++){
+    storeRows[row] = layer_create_with_data(GRect(0, 14 + row * STORE_ROW_HEIGHT, windowBounds.size.w, STORE_ROW_HEIGHT), sizeof(int));
+    *(int*)layer_get_data(storeRows[row]) = row;
+    layer_set_update_proc(storeRows[row], store_row_update_callback);
+    layer_add_child(storeLayer, storeRows[row]);
+  }
+  layer_add_child(windowLayer, storeLayer);
+  // Loads the tip image, the rest waits for loadGame
+  setGameState(game.state);
 
   window_set_click_config_provider_with_context(window, config_provider,  (void*)window);
 
-  timer = app_timer_register(ACCEL_STEP_MS, timer_callback, NULL);
+  scheduleGame();
 }
 
 void handle_deinit() {
-  accel_data_service_unsubscribe();
-  gbitmap_destroy(ship);
-  for(int i = 0; i < 4; i++) gbitmap_destroy(creepBitmap[i]);
+  saveState();
+  saveSnapshot();
+  if(accelSubscribed) accel_data_service_unsubscribe();
+  unloadLevel();
+  destroySprites();
+  if(spriteAtlas) gbitmap_destroy(spriteAtlas);
+  if(tipBitmap) gbitmap_destroy(tipBitmap);
+  for(int row = 0; row < STORE_ROW_COUNT; row++) layer_destroy(storeRows[row]);
+  layer_destroy(storeLayer);
+  text_layer_destroy(levelTextLayer);
+  text_layer_destroy(moneyTextLayer);
+  layer_destroy(hudLayer);
   layer_destroy(layer);
   window_destroy(window);
-  int levelIndex, creepIndex;
-  for(levelIndex = 0; levelIndex < game.levelCount; levelIndex++){
-    for(creepIndex = 0; creepIndex < game.levels[levelIndex].creepCount; creepIndex++){
-      free(game.levels[levelIndex].creeps[creepIndex].rules);
-    }
-    free(game.levels[levelIndex].creeps);
-  }
-  free(game.levels);
+  bulletPoolDestroy(&playerBullets);
+  bulletPoolDestroy(&creepBullets);
+  bulletGridDestroy(&bulletGrid);
+  arenaDestroy(&game.levelArena);
+  free(game.levelOffsets);
 }
 
+// The desktop tools in tools/host drive the game themselves
+#ifndef PHOENIX_HOST
 int main(void) {
   handle_init();
   app_event_loop();
   handle_deinit();
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
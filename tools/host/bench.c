@@ -0,0 +1,243 @@
+// Tick-level benchmark of the game core on the desktop. Each scenario plays
+// the game one step and frame at a time and reports how long each phase of
+// the step took per tick, plus the allocations made and the heap used while
+// playing. It is built with PHOENIX_PROFILE, the phases are the game's own
+// profile timers running on a nanosecond clock.
+//
+//   make bench && ./bench [ticks]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "host.h"
+
+static uint32_t nowNs();
+#define PROFILE_CLOCK() nowNs()
+
+#include "../../src/main.c"
+
+#define DEFAULT_TICKS 20000
+#define WARMUP_TICKS 500
+#define DENSE_COLUMNS 10
+#define DENSE_ROWS 8
+#define DENSE_LEVELS 4
+#define SWEEP_TICKS 60
+#define SWEEP_TILT 400
+#define ACCEL_BATCH_TICKS 5
+
+// The profile's timed phases, ProfileBullets up to ProfileDraw
+#define PHASE_COUNT (ProfileDraw + 1)
+
+static const char* phaseNames[PHASE_COUNT] = { "bullets", "ship", "creeps", "hits", "fire", "draw" };
+
+typedef struct {
+  const char* name;
+  // Level file to play instead of the shipped one, NULL for the shipped one
+  size_t (*buildLevels)(uint8_t* buffer, size_t size);
+  void (*beforeTick)(int tick);
+} Scenario;
+
+static uint64_t phaseNs[PHASE_COUNT];
+static int levelsPlayed;
+
+// Wraps every few seconds, the profile only takes differences of it
+static uint32_t nowNs(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)((uint64_t)now.tv_sec * 1000000000u + now.tv_nsec);
+}
+
+// Keeps the game in a level: a won level moves on to the next one and a
+// lost one is played again
+static void keepPlaying(){
+  if(game.state == LevelState) return;
+  if(game.state == GameOverState) player.armor = player.fullArmor;
+  setGameState(LevelState);
+  resetLevel();
+  // Subscribes to the accelerometer, the loop timer itself never fires
+  scheduleTimers();
+  levelsPlayed++;
+}
+
+// The accelerometer delivers a batch about every fifth step
+static void sweepShip(int tick){
+  host_set_accel((tick / SWEEP_TICKS) % 2 ? SWEEP_TILT : -SWEEP_TILT, 0, 0);
+  if(tick % ACCEL_BATCH_TICKS == 0){
+    AccelData samples[ACCEL_SAMPLES_PER_UPDATE];
+    accel_service_peek(&samples[0]);
+    for(int i = 1; i < ACCEL_SAMPLES_PER_UPDATE; i++) samples[i] = samples[0];
+    host_push_accel(samples, ACCEL_SAMPLES_PER_UPDATE);
+  }
+}
+
+// A game step and the frame after it. The profile is emptied every tick
+// so its 32 bit totals of nanoseconds can't overflow.
+static void runTick(bool timed){
+  profileReset();
+  stepGame();
+  updateHud();
+  requestRedraw();
+  host_render();
+  if(!timed) return;
+  for(int phase = 0; phase < PHASE_COUNT; phase++) phaseNs[phase] += profileStats[phase].total;
+}
+
+// Shipped levels, played through with the ship sweeping across the screen
+
+static void shippedTick(int tick){
+  keepPlaying();
+  sweepShip(tick);
+}
+
+// Shipped levels with both bullet pools kept full and creeps that can't
+// die, the worst case for movement, hits and drawing
+
+static void fillPool(BulletPool* pool, Fixed vy){
+  while(pool->count < pool->capacity){
+    int x = rand() % windowBounds.size.w;
+    int y = rand() % windowBounds.size.h;
+    bulletPoolAdd(pool, TO_FIXED(x), TO_FIXED(y), 0, vy);
+  }
+}
+
+static void fullPoolsTick(int tick){
+  keepPlaying();
+  sweepShip(tick);
+  Level* level = getCurrentLevel();
+  for(int index = 0; index < level->creepCount; index++) level->creeps[index].health = INT16_MAX;
+  rebuildLiveCreeps(level);
+  player.armor = player.fullArmor;
+  fillPool(&playerBullets, -BULLET_SPEED);
+  fillPool(&creepBullets, BULLET_SPEED);
+}
+
+// A grid of creeps marching left and right across the screen, stepping
+// down and back up, each level a little larger than the last
+
+static size_t writeDenseLevel(uint8_t* buffer, int columns, int rows){
+  LevelRecord* record = (LevelRecord*)buffer;
+  CreepRecord* creeps = (CreepRecord*)(record + 1);
+  record->creepCount = columns * rows;
+  record->ruleCount = 4;
+  MovementRule* rules = (MovementRule*)(creeps + record->creepCount);
+  rules[0] = (MovementRule){ FIXED_ONE, 0, 0, WALL, 0 };
+  rules[1] = (MovementRule){ 0, FIXED_ONE, 4, DISTANCE, 0 };
+  rules[2] = (MovementRule){ -FIXED_ONE, 0, 0, WALL, 0 };
+  rules[3] = (MovementRule){ 0, -FIXED_ONE, 4, DISTANCE, 0 };
+  for(int row = 0; row < rows; row++){
+    for(int column = 0; column < columns; column++){
+      CreepRecord* creep = &creeps[row * columns + column];
+      memset(creep, 0, sizeof(CreepRecord));
+      creep->x = 20 + column * 10;
+      creep->y = 22 + row * 9;
+      creep->firstRule = 0;
+      creep->ruleCount = 4;
+      creep->health = 3;
+      creep->type = (row + column) % creepTypeCount;
+    }
+  }
+  return (uint8_t*)(rules + record->ruleCount) - buffer;
+}
+
+// Uses the sprites of the shipped level file
+static size_t buildDenseLevels(uint8_t* buffer, size_t size){
+  LevelFileHeader* header = (LevelFileHeader*)buffer;
+  ResHandle shipped = resource_get_handle(RESOURCE_ID_MOVEMENT_RULES);
+  resource_load_byte_range(shipped, 0, buffer, sizeof(LevelFileHeader));
+  size_t spritesSize = sizeof(SpriteRecord) * header->spriteCount;
+  size_t shippedSprites = sizeof(LevelFileHeader) + sizeof(uint32_t) * (header->levelCount + 1);
+  uint32_t* offsets = (uint32_t*)(header + 1);
+  uint8_t* sprites = (uint8_t*)(offsets + DENSE_LEVELS + 1);
+  resource_load_byte_range(shipped, shippedSprites, sprites, spritesSize);
+  creepTypeCount = header->spriteCount - 1;
+  header->levelCount = DENSE_LEVELS;
+  size_t used = sprites + spritesSize - buffer;
+  uint32_t checksum = fnv1a(FNV_OFFSET_BASIS, sprites, spritesSize);
+  for(int levelIndex = 0; levelIndex < DENSE_LEVELS; levelIndex++){
+    offsets[levelIndex] = used;
+    int columns = DENSE_COLUMNS - DENSE_LEVELS + 1 + levelIndex;
+    // Levels in the file needn't be aligned, they are written aligned
+    // and copied in
+    static uint32_t level[4096];
+    size_t levelSize = writeDenseLevel((uint8_t*)level, columns, DENSE_ROWS);
+    if(used + levelSize > size){
+      fprintf(stderr, "dense levels don't fit\n");
+      exit(2);
+    }
+    memcpy(buffer + used, level, levelSize);
+    checksum = fnv1a(checksum, buffer + used, levelSize);
+    used += levelSize;
+  }
+  offsets[DENSE_LEVELS] = used;
+  header->checksum = checksum;
+  header->size = used;
+  return used;
+}
+
+static const Scenario scenarios[] = {
+  { "shipped", NULL, shippedTick },
+  { "full pools", NULL, fullPoolsTick },
+  { "dense", buildDenseLevels, shippedTick }
+};
+
+static void runScenario(const Scenario* scenario, int ticks){
+  static uint8_t levelFile[32 * 1024];
+  host_set_resource(RESOURCE_ID_MOVEMENT_RULES, NULL, 0);
+  if(scenario->buildLevels){
+    size_t size = scenario->buildLevels(levelFile, sizeof(levelFile));
+    host_set_resource(RESOURCE_ID_MOVEMENT_RULES, levelFile, size);
+  }
+  host_clear_persist();
+  srand(1);
+  gameSeed = 1;
+  gameLoaded = false;
+  gameLoadScheduled = false;
+  handle_init();
+  // The game loads after the first frame
+  host_render();
+  host_advance(0);
+  if(game.levelCount == 0){
+    fprintf(stderr, "%s: no levels\n", scenario->name);
+    exit(1);
+  }
+
+  memset(phaseNs, 0, sizeof(phaseNs));
+  levelsPlayed = 0;
+  for(int tick = 0; tick < WARMUP_TICKS; tick++){
+    scenario->beforeTick(tick);
+    runTick(false);
+  }
+  host_reset_stats();
+  int overflows = playerBullets.overflows + creepBullets.overflows;
+  levelsPlayed = 0;
+  for(int tick = 0; tick < ticks; tick++){
+    scenario->beforeTick(tick);
+    runTick(true);
+  }
+  HostHeapStats heap = host_heap_stats();
+  HostGraphicsStats graphics = host_graphics_stats();
+  overflows = playerBullets.overflows + creepBullets.overflows - overflows;
+
+  uint64_t total = 0;
+  printf("%-11s", scenario->name);
+  for(int phase = 0; phase < PHASE_COUNT; phase++){
+    printf(" %8.0f", (double)phaseNs[phase] / ticks);
+    total += phaseNs[phase];
+  }
+  printf(" %8.0f %7u %7zu %7.1f %7.0f %7d %6d\n", (double)total / ticks, (unsigned)heap.allocations,
+    heap.peak, (double)graphics.drawCalls / ticks, (double)graphics.pixels / ticks, levelsPlayed, overflows);
+  handle_deinit();
+}
+
+int main(int argc, char** argv){
+  int ticks = argc > 1 ? atoi(argv[1]) : DEFAULT_TICKS;
+  if(ticks <= 0){
+    fprintf(stderr, "usage: %s [ticks]\n", argv[0]);
+    return 1;
+  }
+  printf("%d ticks per scenario, ns per tick\n\n", ticks);
+  printf("%-11s", "scenario");
+  for(int phase = 0; phase < PHASE_COUNT; phase++) printf(" %8s", phaseNames[phase]);
+  printf(" %8s %7s %7s %7s %7s %7s %6s\n", "total", "allocs", "heap", "draws", "pixels", "levels", "drops");
+  for(size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) runScenario(&scenarios[i], ticks);
+  return 0;
+}
@@ -0,0 +1,174 @@
+// Plays a fixed script through the tip screen, a level, the store and
+// the next level, and checks every frame rendered against the hashes in
+// a golden file. Also reports what the frames cost to draw.
+//
+//   make frames && ./frames golden_frames.txt      compare
+//   ./frames -w golden_frames.txt                  write the hashes
+//   ./frames -d out golden_frames.txt              also dump frames that differ
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "host.h"
+#include "../../src/main.c"
+
+#undef malloc
+#undef free
+
+#define MAX_FRAMES 4096
+#define MAX_REPORTED 10
+#define PLAY_MS 20000
+#define SWEEP_STEPS 60
+#define SWEEP_TILT 400
+
+static HostFrameStats frames[MAX_FRAMES];
+static int frameCount;
+static uint32_t golden[MAX_FRAMES];
+static int goldenCount = -1;
+static int mismatches;
+static const char* dumpDir;
+
+// The screen as a binary PBM, set bits are black there
+static void dumpFrame(int index){
+  char path[512];
+  snprintf(path, sizeof(path), "%s/frame-%04d.pbm", dumpDir, index);
+  FILE* file = fopen(path, "wb");
+  if(!file){
+    perror(path);
+    return;
+  }
+  const GBitmap* screen = host_frame_buffer();
+  fprintf(file, "P4\n%d %d\n", screen->bounds.size.w, screen->bounds.size.h);
+  for(int y = 0; y < screen->bounds.size.h; y++){
+    const uint8_t* row = (const uint8_t*)screen->addr + y * screen->row_size_bytes;
+    for(int x = 0; x < screen->bounds.size.w; x += 8){
+      uint8_t out = 0;
+      for(int bit = 0; bit < 8; bit++)
+        if(!(row[(x + bit) / 8] & (1 << ((x + bit) % 8)))) out |= 0x80 >> bit;
+      fputc(out, file);
+    }
+  }
+  fclose(file);
+}
+
+static void frameRendered(const HostFrameStats* stats){
+  if(frameCount == MAX_FRAMES) return;
+  int index = frameCount++;
+  frames[index] = *stats;
+  if(goldenCount < 0 || (index < goldenCount && golden[index] == stats->hash)) return;
+  if(mismatches++ < MAX_REPORTED){
+    if(index < goldenCount) printf("frame %d: hash %08x, expected %08x\n", index, stats->hash, golden[index]);
+    else printf("frame %d: not in the golden file\n", index);
+  }
+  if(dumpDir) dumpFrame(index);
+}
+
+static void play(int ms){
+  for(int elapsed = 0; elapsed < ms; elapsed += ACCEL_STEP_MS){
+    host_set_accel((gameTime / SWEEP_STEPS) % 2 ? SWEEP_TILT : -SWEEP_TILT, 0, 0);
+    host_advance(ACCEL_STEP_MS);
+  }
+}
+
+static void runScript(){
+  gameSeed = 1;
+  host_set_frame_hook(frameRendered);
+  handle_init();
+  host_render();
+  host_advance(0);
+  host_click(BUTTON_ID_SELECT);
+  host_advance(INITIAL_READY_COUNT * READY_STEP_MS);
+  play(PLAY_MS);
+  // Straight to the store, buy power, then leave it for the next level
+  handleLevelWin();
+  player.money = storeSelectionCosts[POWER_UP_SELECTION];
+  host_render();
+  host_click(BUTTON_ID_DOWN);
+  host_click(BUTTON_ID_SELECT);
+  for(int i = POWER_UP_SELECTION; i < DONE_SELECTION; i++) host_click(BUTTON_ID_DOWN);
+  host_click(BUTTON_ID_SELECT);
+  host_advance(INITIAL_READY_COUNT * READY_STEP_MS);
+  play(PLAY_MS / 4);
+  handle_deinit();
+  host_set_frame_hook(NULL);
+}
+
+static void readGolden(const char* path){
+  FILE* file = fopen(path, "r");
+  if(!file){
+    perror(path);
+    exit(1);
+  }
+  char line[256];
+  goldenCount = 0;
+  while(fgets(line, sizeof(line), file)){
+    if(line[0] == '#' || line[0] == '\n') continue;
+    if(goldenCount == MAX_FRAMES){
+      fprintf(stderr, "%s: more than %d frames\n", path, MAX_FRAMES);
+      exit(1);
+    }
+    golden[goldenCount++] = strtoul(line, NULL, 16);
+  }
+  fclose(file);
+}
+
+static void writeGolden(const char* path){
+  FILE* file = fopen(path, "w");
+  if(!file){
+    perror(path);
+    exit(1);
+  }
+  fprintf(file, "# Frame hashes of tools/host/frames.c's script, rewrite with frames -w\n");
+  for(int i = 0; i < frameCount; i++) fprintf(file, "%08x\n", frames[i].hash);
+  fclose(file);
+}
+
+static void report(){
+  uint64_t drawCalls = 0, pixels = 0, touched = 0;
+  uint32_t maxDrawCalls = 0, maxPixels = 0;
+  for(int i = 0; i < frameCount; i++){
+    drawCalls += frames[i].drawCalls;
+    pixels += frames[i].pixels;
+    touched += frames[i].touched;
+    maxDrawCalls = MAX(maxDrawCalls, frames[i].drawCalls);
+    maxPixels = MAX(maxPixels, frames[i].pixels);
+  }
+  printf("%d frames, per frame %.1f draw calls (max %u), %.0f pixels written (max %u), overdraw %.2f\n",
+    frameCount, (double)drawCalls / frameCount, (unsigned)maxDrawCalls, (double)pixels / frameCount,
+    (unsigned)maxPixels, touched ? (double)pixels / touched : 0);
+}
+
+static int usage(const char* name){
+  fprintf(stderr, "usage: %s [-w] [-d dir] golden-file\n", name);
+  return 1;
+}
+
+int main(int argc, char** argv){
+  bool write = false;
+  const char* path = NULL;
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i], "-w") == 0) write = true;
+    else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc) dumpDir = argv[++i];
+    else if(!path && argv[i][0] != '-') path = argv[i];
+    else return usage(argv[0]);
+  }
+  if(!path) return usage(argv[0]);
+  setenv("HOST_QUIET", "1", 0);
+  if(!write) readGolden(path);
+  runScript();
+  report();
+  if(write){
+    writeGolden(path);
+    printf("wrote %s\n", path);
+    return 0;
+  }
+  if(frameCount < goldenCount){
+    printf("%d frames, the golden file has %d\n", frameCount, goldenCount);
+    mismatches++;
+  }
+  if(mismatches){
+    printf("%d frames differ\n", mismatches);
+    return 1;
+  }
+  printf("all frames match\n");
+  return 0;
+}
@@ -0,0 +1,61 @@
+// Controls for the desktop stand-in of the Pebble SDK, used by the tools
+// that drive the game without a watch.
+
+#pragma once
+
+#include "pebble.h"
+
+typedef struct {
+  uint32_t drawCalls;
+  uint32_t frames;
+  uint64_t pixels;
+} HostGraphicsStats;
+
+// What rendering one frame cost, and what it drew
+typedef struct {
+  uint32_t drawCalls;
+  // Pixels written, and how many different ones, the rest is overdraw
+  uint32_t pixels;
+  uint32_t touched;
+  // FNV-1a of the screen after the frame
+  uint32_t hash;
+} HostFrameStats;
+
+typedef void (*HostFrameHook)(const HostFrameStats* stats);
+
+typedef struct {
+  size_t used;
+  size_t peak;
+  uint32_t allocations;
+  uint32_t frees;
+} HostHeapStats;
+
+// Moves the virtual clock forward, firing every timer that comes due and
+// rendering after each one like the event loop on the watch would
+void host_advance(uint32_t ms);
+// Renders the window if anything was marked dirty since the last frame,
+// into the screen returned by host_frame_buffer
+void host_render(void);
+// Called after every frame rendered, NULL to stop
+void host_set_frame_hook(HostFrameHook hook);
+// Presses and releases a button
+void host_click(ButtonId button);
+// Holds a button down, and lets go of it. Single clicks fire on release.
+void host_press(ButtonId button);
+void host_release(ButtonId button);
+// What accel_service_peek returns from now on
+void host_set_accel(int16_t x, int16_t y, int16_t z);
+// Hands samples to the accelerometer data subscriber, if any
+void host_push_accel(AccelData* data, uint32_t count);
+// Serves a resource from memory instead of the resources directory, or
+// from the directory again when data is NULL
+void host_set_resource(uint32_t resource_id, const uint8_t* data, size_t size);
+// Forgets everything written with persist_write_*
+void host_clear_persist(void);
+uint64_t host_clock_ms(void);
+// The screen the game captures with graphics_capture_frame_buffer
+const GBitmap* host_frame_buffer(void);
+
+HostGraphicsStats host_graphics_stats(void);
+HostHeapStats host_heap_stats(void);
+void host_reset_stats(void);
@@ -0,0 +1,220 @@
+// Stand-in for the Pebble SDK header so the game can be built and run on
+// a desktop machine. Only the parts of the SDK used by src/main.c are
+// declared. Graphics calls are counted and drawn into a 1-bit frame
+// buffer, resources are read from the resources directory and timers run
+// on a virtual clock driven through host.h.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Geometry
+
+typedef struct {
+  int16_t x;
+  int16_t y;
+} GPoint;
+
+typedef struct {
+  int16_t w;
+  int16_t h;
+} GSize;
+
+typedef struct {
+  GPoint origin;
+  GSize size;
+} GRect;
+
+#define GPoint(x, y) ((GPoint){(x), (y)})
+#define GSize(w, h) ((GSize){(w), (h)})
+#define GRect(x, y, w, h) ((GRect){{(x), (y)}, {(w), (h)}})
+#define GRectZero GRect(0, 0, 0, 0)
+
+bool grect_contains_point(const GRect* rect, const GPoint* point);
+
+// Graphics
+
+// 1-bit, rows padded to 4 bytes, least significant bit first, set bits
+// are white
+typedef struct {
+  void* addr;
+  uint16_t row_size_bytes;
+  uint16_t info_flags;
+  GRect bounds;
+} GBitmap;
+
+typedef enum { GColorClear = -1, GColorBlack = 0, GColorWhite = 1 } GColor;
+typedef enum { GCornerNone = 0 } GCornerMask;
+typedef enum { GTextOverflowModeWordWrap, GTextOverflowModeTrailingEllipsis, GTextOverflowModeFill } GTextOverflowMode;
+typedef enum { GTextAlignmentLeft, GTextAlignmentCenter, GTextAlignmentRight } GTextAlignment;
+typedef struct GTextLayoutCache* GTextLayoutCacheRef;
+typedef struct GFontHost* GFont;
+typedef struct GContext GContext;
+
+#define FONT_KEY_GOTHIC_14 "RESOURCE_ID_GOTHIC_14"
+#define FONT_KEY_GOTHIC_14_BOLD "RESOURCE_ID_GOTHIC_14_BOLD"
+
+GFont fonts_get_system_font(const char* font_key);
+
+GBitmap* gbitmap_create_with_resource(uint32_t resource_id);
+GBitmap* gbitmap_create_as_sub_bitmap(const GBitmap* base_bitmap, GRect sub_rect);
+void gbitmap_destroy(GBitmap* bitmap);
+
+void graphics_context_set_stroke_color(GContext* ctx, GColor color);
+void graphics_context_set_fill_color(GContext* ctx, GColor color);
+void graphics_context_set_text_color(GContext* ctx, GColor color);
+void graphics_draw_pixel(GContext* ctx, GPoint point);
+void graphics_draw_line(GContext* ctx, GPoint p0, GPoint p1);
+void graphics_fill_rect(GContext* ctx, GRect rect, uint16_t corner_radius, GCornerMask corner_mask);
+void graphics_fill_circle(GContext* ctx, GPoint p, uint16_t radius);
+void graphics_draw_bitmap_in_rect(GContext* ctx, const GBitmap* bitmap, GRect rect);
+void graphics_draw_text(GContext* ctx, const char* text, GFont font, GRect box,
+  GTextOverflowMode overflow_mode, GTextAlignment alignment, GTextLayoutCacheRef layout);
+GBitmap* graphics_capture_frame_buffer(GContext* ctx);
+bool graphics_release_frame_buffer(GContext* ctx, GBitmap* buffer);
+
+// Layers and windows
+
+typedef struct Layer Layer;
+typedef struct TextLayer TextLayer;
+typedef struct Window Window;
+typedef void (*LayerUpdateProc)(Layer* layer, GContext* ctx);
+
+Layer* layer_create(GRect frame);
+Layer* layer_create_with_data(GRect frame, size_t data_size);
+void layer_destroy(Layer* layer);
+void* layer_get_data(const Layer* layer);
+void layer_set_update_proc(Layer* layer, LayerUpdateProc update_proc);
+void layer_add_child(Layer* parent, Layer* child);
+void layer_mark_dirty(Layer* layer);
+GRect layer_get_frame(const Layer* layer);
+GRect layer_get_bounds(const Layer* layer);
+void layer_set_hidden(Layer* layer, bool hidden);
+
+TextLayer* text_layer_create(GRect frame);
+void text_layer_destroy(TextLayer* text_layer);
+Layer* text_layer_get_layer(TextLayer* text_layer);
+void text_layer_set_text(TextLayer* text_layer, const char* text);
+void text_layer_set_font(TextLayer* text_layer, GFont font);
+void text_layer_set_text_alignment(TextLayer* text_layer, GTextAlignment text_alignment);
+void text_layer_set_background_color(TextLayer* text_layer, GColor color);
+void text_layer_set_text_color(TextLayer* text_layer, GColor color);
+
+Window* window_create(void);
+void window_destroy(Window* window);
+void window_stack_push(Window* window, bool animated);
+void window_stack_pop_all(bool animated);
+Layer* window_get_root_layer(const Window* window);
+void window_set_background_color(Window* window, GColor background_color);
+
+// Buttons
+
+typedef enum { BUTTON_ID_BACK, BUTTON_ID_UP, BUTTON_ID_SELECT, BUTTON_ID_DOWN, NUM_BUTTONS } ButtonId;
+typedef void* ClickRecognizerRef;
+typedef void (*ClickHandler)(ClickRecognizerRef recognizer, void* context);
+typedef void (*ClickConfigProvider)(void* context);
+
+void window_set_click_config_provider_with_context(Window* window, ClickConfigProvider click_config_provider, void* context);
+void window_set_click_context(ButtonId button_id, void* context);
+void window_single_click_subscribe(ButtonId button_id, ClickHandler handler);
+void window_long_click_subscribe(ButtonId button_id, uint16_t delay_ms, ClickHandler down_handler, ClickHandler up_handler);
+void window_raw_click_subscribe(ButtonId button_id, ClickHandler down_handler, ClickHandler up_handler, void* context);
+ButtonId click_recognizer_get_button_id(ClickRecognizerRef recognizer);
+
+// Timers and time
+
+typedef struct AppTimer AppTimer;
+typedef void (*AppTimerCallback)(void* data);
+
+AppTimer* app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void* callback_data);
+bool app_timer_reschedule(AppTimer* timer_handle, uint32_t new_timeout_ms);
+void app_timer_cancel(AppTimer* timer_handle);
+uint16_t time_ms(time_t* tloc, uint16_t* out_ms);
+
+// Accelerometer
+
+typedef struct {
+  int16_t x;
+  int16_t y;
+  int16_t z;
+  bool did_vibrate;
+  uint64_t timestamp;
+} AccelData;
+
+typedef enum {
+  ACCEL_SAMPLING_10HZ = 10,
+  ACCEL_SAMPLING_25HZ = 25,
+  ACCEL_SAMPLING_50HZ = 50,
+  ACCEL_SAMPLING_100HZ = 100
+} AccelSamplingRate;
+
+typedef void (*AccelDataHandler)(AccelData* data, uint32_t num_samples);
+
+void accel_data_service_subscribe(uint32_t samples_per_update, AccelDataHandler handler);
+void accel_data_service_unsubscribe(void);
+int accel_service_set_sampling_rate(AccelSamplingRate rate);
+int accel_service_peek(AccelData* data);
+
+// Resources, generated by the SDK from appinfo.json on the watch
+
+typedef const void* ResHandle;
+
+enum {
+  RESOURCE_ID_MOVEMENT_RULES = 1,
+  RESOURCE_ID_TIP_IMAGE,
+  RESOURCE_ID_MENU_IMAGE,
+  RESOURCE_ID_SPRITES_IMAGE,
+  RESOURCE_ID_COUNT
+};
+
+ResHandle resource_get_handle(uint32_t resource_id);
+size_t resource_size(ResHandle h);
+size_t resource_load(ResHandle h, uint8_t* buffer, size_t max_length);
+size_t resource_load_byte_range(ResHandle h, uint32_t start_offset, uint8_t* buffer, size_t num_bytes);
+
+// Storage
+
+typedef int32_t status_t;
+
+#define PERSIST_DATA_MAX_LENGTH 256
+
+bool persist_exists(uint32_t key);
+int32_t persist_read_int(uint32_t key);
+status_t persist_write_int(uint32_t key, int32_t value);
+int persist_read_data(uint32_t key, void* buffer, size_t buffer_size);
+int persist_write_data(uint32_t key, const void* data, size_t size);
+status_t persist_delete(uint32_t key);
+
+// Heap, allocations are counted and fail past the size of the app heap on
+// the watch
+
+size_t heap_bytes_used(void);
+size_t heap_bytes_free(void);
+void* host_malloc(size_t size);
+void host_free(void* ptr);
+
+#define malloc(size) host_malloc(size)
+#define free(ptr) host_free(ptr)
+
+// Logging and the rest
+
+enum {
+  APP_LOG_LEVEL_ERROR = 1,
+  APP_LOG_LEVEL_WARNING = 50,
+  APP_LOG_LEVEL_INFO = 100,
+  APP_LOG_LEVEL_DEBUG = 200,
+  APP_LOG_LEVEL_DEBUG_VERBOSE = 255
+};
+
+void app_log(uint8_t log_level, const char* src_filename, int src_line_number, const char* fmt, ...);
+
+#define APP_LOG(level, fmt, ...) app_log(level, __FILE__, __LINE__, fmt, ## __VA_ARGS__)
+
+void vibes_short_pulse(void);
+void app_event_loop(void);
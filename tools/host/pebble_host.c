@@ -0,0 +1,1028 @@
+// Desktop implementation of the Pebble SDK stand-in declared in pebble.h.
+// Everything runs on one thread: timers fire from host_advance() on a
+// virtual clock and the window is rendered after each callback the way the
+// event loop on the watch would.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <zlib.h>
+#include "host.h"
+
+#undef malloc
+#undef free
+
+#define HOST_HEAP_SIZE (24 * 1024)
+#define HOST_ALLOC_HEADER 16
+#define MAX_TIMERS 16
+#define MAX_CHILDREN 8
+#define PERSIST_SLOTS 512
+#define SCREEN_WIDTH 144
+#define SCREEN_HEIGHT 168
+#define SCREEN_ROW_BYTES 20
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define ABS(a) ((a) < 0 ? -(a) : (a))
+#define TEXT_ADVANCE 6
+#define TEXT_LINE_HEIGHT 14
+#define TEXT_TOP 3
+#define TEXT_GLYPH_WIDTH 4
+#define TEXT_GLYPH_HEIGHT 8
+
+struct Layer {
+  GRect frame;
+  LayerUpdateProc updateProc;
+  Layer* children[MAX_CHILDREN];
+  int childCount;
+  bool hidden;
+  void* data;
+};
+
+struct TextLayer {
+  Layer layer;
+  const char* text;
+  GFont font;
+  GTextAlignment alignment;
+  GColor background;
+  GColor textColor;
+};
+
+struct Window {
+  Layer root;
+  GColor background;
+};
+
+struct AppTimer {
+  uint64_t due;
+  AppTimerCallback callback;
+  void* data;
+  bool live;
+};
+
+struct GContext {
+  GColor strokeColor;
+  GColor fillColor;
+  GColor textColor;
+  // Where the layer being drawn is on screen, and the part of the screen
+  // it can draw on
+  GPoint offset;
+  GRect clip;
+};
+
+typedef struct {
+  uint8_t* data;
+  size_t size;
+} HostResource;
+
+static const char* resourceFiles[RESOURCE_ID_COUNT] = {
+  NULL,
+  "movement/rules.bin",
+  "images/tip.png",
+  "images/menu.png",
+  "images/sprites.png"
+};
+
+static HostResource resources[RESOURCE_ID_COUNT];
+static uint64_t clockMs = 0;
+static struct AppTimer timers[MAX_TIMERS];
+static Window* topWindow;
+static bool dirty;
+static ClickHandler clickHandlers[NUM_BUTTONS];
+static void* clickContext;
+static struct {
+  ClickHandler down;
+  ClickHandler up;
+  void* context;
+} rawClickHandlers[NUM_BUTTONS];
+static AccelData accel;
+static AccelDataHandler accelHandler;
+static uint32_t accelSamplesPerUpdate;
+static uint32_t accelSamplingRate = ACCEL_SAMPLING_25HZ;
+static uint64_t nextAccelBatch;
+static HostGraphicsStats graphicsStats;
+static HostHeapStats heapStats;
+static uint32_t screen[SCREEN_HEIGHT * SCREEN_ROW_BYTES / 4];
+static GBitmap screenBitmap = { screen, SCREEN_ROW_BYTES, 0, { { 0, 0 }, { SCREEN_WIDTH, SCREEN_HEIGHT } } };
+static bool screenCaptured;
+// Pixels written in the frame being rendered, to tell overdraw apart
+static uint32_t touched[SCREEN_HEIGHT * SCREEN_ROW_BYTES / 4];
+static HostFrameStats frameStats;
+static HostFrameHook frameHook;
+
+static struct {
+  bool used;
+  size_t size;
+  uint8_t data[PERSIST_DATA_MAX_LENGTH];
+} persistSlots[PERSIST_SLOTS];
+
+// Heap
+
+// Fails once the app heap of the watch would be used up
+void* host_malloc(size_t size) {
+  if(size > HOST_HEAP_SIZE - heapStats.used) {
+    return NULL;
+  }
+  size_t* block = malloc(size + HOST_ALLOC_HEADER);
+  if(!block) {
+    return NULL;
+  }
+  block[0] = size;
+  heapStats.used += size;
+  heapStats.allocations++;
+  if(heapStats.used > heapStats.peak) {
+    heapStats.peak = heapStats.used;
+  }
+  return (uint8_t*)block + HOST_ALLOC_HEADER;
+}
+
+void host_free(void* ptr) {
+  if(!ptr) {
+    return;
+  }
+  size_t* block = (size_t*)((uint8_t*)ptr - HOST_ALLOC_HEADER);
+  heapStats.used -= block[0];
+  heapStats.frees++;
+  free(block);
+}
+
+static void* hostCalloc(size_t size) {
+  void* ptr = host_malloc(size);
+  if(ptr) {
+    memset(ptr, 0, size);
+  }
+  return ptr;
+}
+
+size_t heap_bytes_used(void) {
+  return heapStats.used;
+}
+
+size_t heap_bytes_free(void) {
+  return heapStats.used < HOST_HEAP_SIZE ? HOST_HEAP_SIZE - heapStats.used : 0;
+}
+
+// Logging
+
+void app_log(uint8_t log_level, const char* src_filename, int src_line_number, const char* fmt, ...) {
+  if(getenv("HOST_QUIET")) {
+    return;
+  }
+  va_list args;
+  va_start(args, fmt);
+  fprintf(stderr, "[%s:%d] ", src_filename, src_line_number);
+  vfprintf(stderr, fmt, args);
+  fputc('\n', stderr);
+  va_end(args);
+}
+
+// Resources
+
+static HostResource* getResource(uint32_t id) {
+  if(id == 0 || id >= RESOURCE_ID_COUNT) {
+    fprintf(stderr, "unknown resource %u\n", (unsigned)id);
+    exit(2);
+  }
+  HostResource* resource = &resources[id];
+  if(resource->data) {
+    return resource;
+  }
+
+  const char* dir = getenv("PHOENIX_RESOURCES");
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s", dir ? dir : PHOENIX_RESOURCES, resourceFiles[id]);
+  FILE* file = fopen(path, "rb");
+  if(!file) {
+    fprintf(stderr, "missing resource %s\n", path);
+    exit(2);
+  }
+  fseek(file, 0, SEEK_END);
+  resource->size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  resource->data = malloc(resource->size);
+  if(fread(resource->data, 1, resource->size, file) != resource->size) {
+    fprintf(stderr, "could not read %s\n", path);
+    exit(2);
+  }
+  fclose(file);
+  return resource;
+}
+
+void host_set_resource(uint32_t resource_id, const uint8_t* data, size_t size) {
+  HostResource* resource = &resources[resource_id];
+  free(resource->data);
+  resource->data = NULL;
+  if(!data) {
+    return;
+  }
+  resource->data = malloc(size);
+  resource->size = size;
+  memcpy(resource->data, data, size);
+}
+
+ResHandle resource_get_handle(uint32_t resource_id) {
+  return (ResHandle)(uintptr_t)resource_id;
+}
+
+size_t resource_size(ResHandle h) {
+  return getResource((uintptr_t)h)->size;
+}
+
+size_t resource_load_byte_range(ResHandle h, uint32_t start_offset, uint8_t* buffer, size_t num_bytes) {
+  HostResource* resource = getResource((uintptr_t)h);
+  if(start_offset > resource->size) {
+    return 0;
+  }
+  if(num_bytes > resource->size - start_offset) {
+    num_bytes = resource->size - start_offset;
+  }
+  memcpy(buffer, resource->data + start_offset, num_bytes);
+  return num_bytes;
+}
+
+size_t resource_load(ResHandle h, uint8_t* buffer, size_t max_length) {
+  return resource_load_byte_range(h, 0, buffer, max_length);
+}
+
+// Bitmaps, decoded from the PNG resources into the 1-bit watch format
+
+static uint32_t readBigEndian(const uint8_t* bytes) {
+  return (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+}
+
+static int paethPredictor(int a, int b, int c) {
+  int p = a + b - c;
+  int pa = abs(p - a);
+  int pb = abs(p - b);
+  int pc = abs(p - c);
+  if(pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
+}
+
+static void unfilterRows(uint8_t* raw, size_t stride, uint32_t height, int bytesPerPixel) {
+  uint8_t* previous = calloc(stride, 1);
+  for(uint32_t y = 0; y < height; y++) {
+    uint8_t* row = raw + y * (stride + 1) + 1;
+    int filter = row[-1];
+    for(size_t i = 0; i < stride; i++) {
+      int a = i >= (size_t)bytesPerPixel ? row[i - bytesPerPixel] : 0;
+      int b = previous[i];
+      int c = i >= (size_t)bytesPerPixel ? previous[i - bytesPerPixel] : 0;
+      int prediction = 0;
+      switch(filter) {
+        case 1: prediction = a; break;
+        case 2: prediction = b; break;
+        case 3: prediction = (a + b) / 2; break;
+        case 4: prediction = paethPredictor(a, b, c); break;
+      }
+      row[i] = (uint8_t)(row[i] + prediction);
+    }
+    memcpy(previous, row, stride);
+  }
+  free(previous);
+}
+
+GBitmap* gbitmap_create_with_resource(uint32_t resource_id) {
+  HostResource* resource = getResource(resource_id);
+  const uint8_t* png = resource->data;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  int depth = 0;
+  int colorType = 0;
+  bool palette[256];
+  uint8_t* compressed = NULL;
+  size_t compressedSize = 0;
+
+  memset(palette, 1, sizeof(palette));
+  for(size_t offset = 8; offset + 8 <= resource->size;) {
+    uint32_t length = readBigEndian(png + offset);
+    const uint8_t* type = png + offset + 4;
+    const uint8_t* chunk = png + offset + 8;
+    if(!memcmp(type, "IHDR", 4)) {
+      width = readBigEndian(chunk);
+      height = readBigEndian(chunk + 4);
+      depth = chunk[8];
+      colorType = chunk[9];
+    }else if(!memcmp(type, "PLTE", 4)) {
+      for(uint32_t i = 0; i < length / 3; i++) {
+        palette[i] = chunk[i * 3] + chunk[i * 3 + 1] + chunk[i * 3 + 2] > 384;
+      }
+    }else if(!memcmp(type, "IDAT", 4)) {
+      compressed = realloc(compressed, compressedSize + length);
+      memcpy(compressed + compressedSize, chunk, length);
+      compressedSize += length;
+    }
+    offset += 12 + length;
+  }
+
+  int channels = colorType == 2 ? 3 : colorType == 4 ? 2 : colorType == 6 ? 4 : 1;
+  size_t stride = (width * depth * channels + 7) / 8;
+  uLongf rawSize = (stride + 1) * height;
+  uint8_t* raw = malloc(rawSize);
+  if(uncompress(raw, &rawSize, compressed, compressedSize) != Z_OK) {
+    fprintf(stderr, "could not decode image resource %u\n", (unsigned)resource_id);
+    exit(2);
+  }
+  int bytesPerPixel = (depth * channels + 7) / 8;
+  unfilterRows(raw, stride, height, bytesPerPixel);
+
+  GBitmap* bitmap = hostCalloc(sizeof(GBitmap));
+  bitmap->row_size_bytes = ((width + 31) / 32) * 4;
+  bitmap->bounds = GRect(0, 0, width, height);
+  uint8_t* bits = hostCalloc(bitmap->row_size_bytes * height);
+  bitmap->addr = bits;
+  for(uint32_t y = 0; y < height; y++) {
+    const uint8_t* row = raw + y * (stride + 1) + 1;
+    for(uint32_t x = 0; x < width; x++) {
+      bool white;
+      if(colorType == 0 || colorType == 3) {
+        int value = (row[x * depth / 8] >> (8 - depth - (x * depth) % 8)) & ((1 << depth) - 1);
+        white = colorType == 3 ? palette[value] : value * 2 >= (1 << depth);
+      }else{
+        white = row[x * bytesPerPixel] > 127;
+      }
+      if(white) {
+        bits[y * bitmap->row_size_bytes + x / 8] |= 1 << (x % 8);
+      }
+    }
+  }
+  free(raw);
+  free(compressed);
+  return bitmap;
+}
+
+// Sub bitmaps share their parent's pixels, info_flags marks them as such
+GBitmap* gbitmap_create_as_sub_bitmap(const GBitmap* base_bitmap, GRect sub_rect) {
+  GBitmap* bitmap = hostCalloc(sizeof(GBitmap));
+  *bitmap = *base_bitmap;
+  bitmap->bounds = sub_rect;
+  bitmap->info_flags = 1;
+  return bitmap;
+}
+
+void gbitmap_destroy(GBitmap* bitmap) {
+  if(bitmap && !bitmap->info_flags) {
+    host_free(bitmap->addr);
+  }
+  host_free(bitmap);
+}
+
+// Graphics, rasterized into the 1-bit screen buffer. Every call counts
+// as a draw call and every pixel it writes, clipped to the layer, as a
+// pixel written.
+
+static void plot(GContext* ctx, int x, int y, GColor color) {
+  x += ctx->offset.x;
+  y += ctx->offset.y;
+  GPoint point = GPoint(x, y);
+  if(color == GColorClear || !grect_contains_point(&ctx->clip, &point)) {
+    return;
+  }
+  uint32_t bit = 1u << (x % 32);
+  uint32_t* word = &screen[y * SCREEN_ROW_BYTES / 4 + x / 32];
+  if(color == GColorWhite) {
+    *word |= bit;
+  }else{
+    *word &= ~bit;
+  }
+  touched[y * SCREEN_ROW_BYTES / 4 + x / 32] |= bit;
+  frameStats.pixels++;
+  graphicsStats.pixels++;
+}
+
+static void countDrawCall(void) {
+  frameStats.drawCalls++;
+  graphicsStats.drawCalls++;
+}
+
+static GRect intersectRects(GRect a, GRect b) {
+  int x = MAX(a.origin.x, b.origin.x);
+  int y = MAX(a.origin.y, b.origin.y);
+  int right = MIN(a.origin.x + a.size.w, b.origin.x + b.size.w);
+  int bottom = MIN(a.origin.y + a.size.h, b.origin.y + b.size.h);
+  return GRect(x, y, MAX(right - x, 0), MAX(bottom - y, 0));
+}
+
+// Same as plotting every pixel of the rect, a word at a time
+static void fillRect(GContext* ctx, GRect rect, GColor color) {
+  rect.origin.x += ctx->offset.x;
+  rect.origin.y += ctx->offset.y;
+  rect = intersectRects(rect, ctx->clip);
+  if(color == GColorClear || rect.size.w == 0 || rect.size.h == 0) {
+    return;
+  }
+  int right = rect.origin.x + rect.size.w;
+  for(int y = rect.origin.y; y < rect.origin.y + rect.size.h; y++) {
+    uint32_t* row = &screen[y * SCREEN_ROW_BYTES / 4];
+    uint32_t* touchedRow = &touched[y * SCREEN_ROW_BYTES / 4];
+    for(int x = rect.origin.x; x < right; x = (x / 32 + 1) * 32) {
+      int end = MIN(right, (x / 32 + 1) * 32);
+      uint32_t mask = (end - x == 32 ? ~0u : ((1u << (end - x)) - 1)) << (x % 32);
+      if(color == GColorWhite) {
+        row[x / 32] |= mask;
+      }else{
+        row[x / 32] &= ~mask;
+      }
+      touchedRow[x / 32] |= mask;
+    }
+  }
+  frameStats.pixels += rect.size.w * rect.size.h;
+  graphicsStats.pixels += rect.size.w * rect.size.h;
+}
+
+void graphics_context_set_stroke_color(GContext* ctx, GColor color) {
+  ctx->strokeColor = color;
+}
+
+void graphics_context_set_fill_color(GContext* ctx, GColor color) {
+  ctx->fillColor = color;
+}
+
+void graphics_context_set_text_color(GContext* ctx, GColor color) {
+  ctx->textColor = color;
+}
+
+void graphics_draw_pixel(GContext* ctx, GPoint point) {
+  countDrawCall();
+  plot(ctx, point.x, point.y, ctx->strokeColor);
+}
+
+void graphics_draw_line(GContext* ctx, GPoint p0, GPoint p1) {
+  countDrawCall();
+  int dx = ABS(p1.x - p0.x);
+  int dy = -ABS(p1.y - p0.y);
+  int stepX = p0.x < p1.x ? 1 : -1;
+  int stepY = p0.y < p1.y ? 1 : -1;
+  int error = dx + dy;
+  int x = p0.x;
+  int y = p0.y;
+  for(;;) {
+    plot(ctx, x, y, ctx->strokeColor);
+    if(x == p1.x && y == p1.y) {
+      break;
+    }
+    if(error * 2 >= dy) {
+      error += dy;
+      x += stepX;
+    }
+    if(error * 2 <= dx) {
+      error += dx;
+      y += stepY;
+    }
+  }
+}
+
+// Corners are always square
+void graphics_fill_rect(GContext* ctx, GRect rect, uint16_t corner_radius, GCornerMask corner_mask) {
+  countDrawCall();
+  fillRect(ctx, rect, ctx->fillColor);
+}
+
+void graphics_fill_circle(GContext* ctx, GPoint p, uint16_t radius) {
+  countDrawCall();
+  int r = radius;
+  for(int y = -r; y <= r; y++) {
+    for(int x = -r; x <= r; x++) {
+      if(x * x + y * y <= r * r) {
+        plot(ctx, p.x + x, p.y + y, ctx->fillColor);
+      }
+    }
+  }
+}
+
+// Copies black and white pixels alike, tiling the bitmap over the rect
+void graphics_draw_bitmap_in_rect(GContext* ctx, const GBitmap* bitmap, GRect rect) {
+  countDrawCall();
+  const uint8_t* bits = bitmap->addr;
+  GRect source = bitmap->bounds;
+  if(source.size.w <= 0 || source.size.h <= 0) {
+    return;
+  }
+  for(int y = 0; y < rect.size.h; y++) {
+    const uint8_t* row = bits + (source.origin.y + y % source.size.h) * bitmap->row_size_bytes;
+    for(int x = 0; x < rect.size.w; x++) {
+      int sourceX = source.origin.x + x % source.size.w;
+      bool white = row[sourceX / 8] & (1 << (sourceX % 8));
+      plot(ctx, rect.origin.x + x, rect.origin.y + y, white ? GColorWhite : GColorBlack);
+    }
+  }
+}
+
+// There are no fonts here. Each character is a cell with its code's bits
+// as the pattern, so text of a different length or content still draws a
+// different frame. Lines wrap at the box's width.
+void graphics_draw_text(GContext* ctx, const char* text, GFont font, GRect box,
+    GTextOverflowMode overflow_mode, GTextAlignment alignment, GTextLayoutCacheRef layout) {
+  countDrawCall();
+  int perLine = MAX(box.size.w / TEXT_ADVANCE, 1);
+  GContext boxed = *ctx;
+  GRect screenBox = GRect(box.origin.x + ctx->offset.x, box.origin.y + ctx->offset.y, box.size.w, box.size.h);
+  boxed.clip = intersectRects(ctx->clip, screenBox);
+  int length = strlen(text);
+  for(int first = 0, line = 0; first < length; first += perLine, line++) {
+    int count = MIN(length - first, perLine);
+    int x = box.origin.x;
+    if(alignment == GTextAlignmentRight) {
+      x += box.size.w - count * TEXT_ADVANCE;
+    }else if(alignment == GTextAlignmentCenter) {
+      x += (box.size.w - count * TEXT_ADVANCE) / 2;
+    }
+    int y = box.origin.y + line * TEXT_LINE_HEIGHT + TEXT_TOP;
+    for(int i = 0; i < count; i++) {
+      uint8_t code = text[first + i];
+      if(code == ' ') {
+        continue;
+      }
+      for(int row = 0; row < TEXT_GLYPH_HEIGHT; row++) {
+        for(int column = 0; column < TEXT_GLYPH_WIDTH; column++) {
+          if(code & (1 << ((row * TEXT_GLYPH_WIDTH + column) % 8))) {
+            plot(&boxed, x + i * TEXT_ADVANCE + column, y + row, ctx->textColor);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Pixels the game writes into the captured buffer aren't counted
+GBitmap* graphics_capture_frame_buffer(GContext* ctx) {
+  if(screenCaptured) {
+    return NULL;
+  }
+  countDrawCall();
+  screenCaptured = true;
+  return &screenBitmap;
+}
+
+bool graphics_release_frame_buffer(GContext* ctx, GBitmap* buffer) {
+  if(!screenCaptured || buffer != &screenBitmap) {
+    return false;
+  }
+  screenCaptured = false;
+  return true;
+}
+
+GFont fonts_get_system_font(const char* font_key) {
+  return (GFont)font_key;
+}
+
+bool grect_contains_point(const GRect* rect, const GPoint* point) {
+  return point->x >= rect->origin.x && point->x < rect->origin.x + rect->size.w &&
+    point->y >= rect->origin.y && point->y < rect->origin.y + rect->size.h;
+}
+
+// Layers and windows
+
+Layer* layer_create(GRect frame) {
+  Layer* layer = hostCalloc(sizeof(Layer));
+  layer->frame = frame;
+  return layer;
+}
+
+Layer* layer_create_with_data(GRect frame, size_t data_size) {
+  Layer* layer = layer_create(frame);
+  layer->data = hostCalloc(data_size);
+  return layer;
+}
+
+void layer_destroy(Layer* layer) {
+  if(layer) {
+    host_free(layer->data);
+  }
+  host_free(layer);
+}
+
+void* layer_get_data(const Layer* layer) {
+  return layer->data;
+}
+
+void layer_set_update_proc(Layer* layer, LayerUpdateProc update_proc) {
+  layer->updateProc = update_proc;
+}
+
+void layer_add_child(Layer* parent, Layer* child) {
+  if(parent->childCount < MAX_CHILDREN) {
+    parent->children[parent->childCount++] = child;
+  }
+}
+
+void layer_mark_dirty(Layer* layer) {
+  dirty = true;
+}
+
+GRect layer_get_frame(const Layer* layer) {
+  return layer->frame;
+}
+
+GRect layer_get_bounds(const Layer* layer) {
+  return GRect(0, 0, layer->frame.size.w, layer->frame.size.h);
+}
+
+void layer_set_hidden(Layer* layer, bool hidden) {
+  if(layer->hidden != hidden) {
+    layer->hidden = hidden;
+    dirty = true;
+  }
+}
+
+// Drawn like the watch does, the background over the whole layer and the
+// text on top
+static void textLayerUpdate(Layer* layer, GContext* ctx) {
+  TextLayer* textLayer = (TextLayer*)layer;
+  GRect bounds = layer_get_bounds(layer);
+  graphics_context_set_fill_color(ctx, textLayer->background);
+  graphics_fill_rect(ctx, bounds, 0, GCornerNone);
+  if(textLayer->text) {
+    graphics_context_set_text_color(ctx, textLayer->textColor);
+    graphics_draw_text(ctx, textLayer->text, textLayer->font, bounds, GTextOverflowModeWordWrap,
+      textLayer->alignment, NULL);
+  }
+}
+
+TextLayer* text_layer_create(GRect frame) {
+  TextLayer* textLayer = hostCalloc(sizeof(TextLayer));
+  textLayer->layer.frame = frame;
+  textLayer->layer.updateProc = textLayerUpdate;
+  textLayer->alignment = GTextAlignmentLeft;
+  textLayer->background = GColorWhite;
+  textLayer->textColor = GColorBlack;
+  return textLayer;
+}
+
+void text_layer_destroy(TextLayer* text_layer) {
+  host_free(text_layer);
+}
+
+Layer* text_layer_get_layer(TextLayer* text_layer) {
+  return &text_layer->layer;
+}
+
+void text_layer_set_text(TextLayer* text_layer, const char* text) {
+  text_layer->text = text;
+  dirty = true;
+}
+
+void text_layer_set_font(TextLayer* text_layer, GFont font) {
+  text_layer->font = font;
+  dirty = true;
+}
+
+void text_layer_set_text_alignment(TextLayer* text_layer, GTextAlignment text_alignment) {
+  text_layer->alignment = text_alignment;
+  dirty = true;
+}
+
+void text_layer_set_background_color(TextLayer* text_layer, GColor color) {
+  text_layer->background = color;
+  dirty = true;
+}
+
+void text_layer_set_text_color(TextLayer* text_layer, GColor color) {
+  text_layer->textColor = color;
+  dirty = true;
+}
+
+Window* window_create(void) {
+  Window* window = hostCalloc(sizeof(Window));
+  window->root.frame = GRect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+  return window;
+}
+
+void window_destroy(Window* window) {
+  host_free(window);
+}
+
+void window_stack_push(Window* window, bool animated) {
+  topWindow = window;
+  dirty = true;
+}
+
+void window_stack_pop_all(bool animated) {
+  topWindow = NULL;
+}
+
+Layer* window_get_root_layer(const Window* window) {
+  return (Layer*)&window->root;
+}
+
+void window_set_background_color(Window* window, GColor background_color) {
+  window->background = background_color;
+}
+
+// Buttons
+
+void window_set_click_config_provider_with_context(Window* window, ClickConfigProvider click_config_provider, void* context) {
+  clickContext = context;
+  click_config_provider(context);
+}
+
+void window_set_click_context(ButtonId button_id, void* context) {
+}
+
+void window_single_click_subscribe(ButtonId button_id, ClickHandler handler) {
+  clickHandlers[button_id] = handler;
+}
+
+void window_long_click_subscribe(ButtonId button_id, uint16_t delay_ms, ClickHandler down_handler, ClickHandler up_handler) {
+}
+
+void window_raw_click_subscribe(ButtonId button_id, ClickHandler down_handler, ClickHandler up_handler, void* context) {
+  rawClickHandlers[button_id].down = down_handler;
+  rawClickHandlers[button_id].up = up_handler;
+  rawClickHandlers[button_id].context = context;
+}
+
+// A recognizer is just the button it belongs to, plus one to keep it
+// from being NULL
+static ClickRecognizerRef recognizerFor(ButtonId button) {
+  return (ClickRecognizerRef)(intptr_t)(button + 1);
+}
+
+ButtonId click_recognizer_get_button_id(ClickRecognizerRef recognizer) {
+  return (ButtonId)((intptr_t)recognizer - 1);
+}
+
+// Timers and time
+
+AppTimer* app_timer_register(uint32_t timeout_ms, AppTimerCallback callback, void* callback_data) {
+  for(int i = 0; i < MAX_TIMERS; i++) {
+    if(!timers[i].live) {
+      timers[i] = (struct AppTimer){ clockMs + timeout_ms, callback, callback_data, true };
+      return &timers[i];
+    }
+  }
+  fprintf(stderr, "out of timers\n");
+  exit(2);
+}
+
+bool app_timer_reschedule(AppTimer* timer_handle, uint32_t new_timeout_ms) {
+  if(!timer_handle->live) {
+    return false;
+  }
+  timer_handle->due = clockMs + new_timeout_ms;
+  return true;
+}
+
+void app_timer_cancel(AppTimer* timer_handle) {
+  if(timer_handle) {
+    timer_handle->live = false;
+  }
+}
+
+uint16_t time_ms(time_t* tloc, uint16_t* out_ms) {
+  if(tloc) {
+    *tloc = clockMs / 1000;
+  }
+  if(out_ms) {
+    *out_ms = clockMs % 1000;
+  }
+  return clockMs % 1000;
+}
+
+// Accelerometer, subscribers get batches of the value set with
+// host_set_accel at the sampling rate
+
+static uint32_t accelBatchPeriod(void) {
+  return accelSamplesPerUpdate * 1000 / accelSamplingRate;
+}
+
+void accel_data_service_subscribe(uint32_t samples_per_update, AccelDataHandler handler) {
+  accelHandler = handler;
+  accelSamplesPerUpdate = samples_per_update;
+  nextAccelBatch = clockMs + accelBatchPeriod();
+}
+
+void accel_data_service_unsubscribe(void) {
+  accelHandler = NULL;
+}
+
+int accel_service_set_sampling_rate(AccelSamplingRate rate) {
+  accelSamplingRate = rate;
+  nextAccelBatch = clockMs + accelBatchPeriod();
+  return 0;
+}
+
+static bool accelBatchDue(uint64_t time) {
+  return accelHandler && accelSamplesPerUpdate > 0 && nextAccelBatch <= time;
+}
+
+static void deliverAccelBatch(void) {
+  AccelData samples[32];
+  uint32_t count = accelSamplesPerUpdate < 32 ? accelSamplesPerUpdate : 32;
+  for(uint32_t i = 0; i < count; i++) {
+    samples[i] = accel;
+    samples[i].timestamp = clockMs - (count - 1 - i) * 1000 / accelSamplingRate;
+  }
+  nextAccelBatch += accelBatchPeriod();
+  accelHandler(samples, count);
+}
+
+int accel_service_peek(AccelData* data) {
+  *data = accel;
+  return 0;
+}
+
+// Storage, kept in memory for the life of the process
+
+bool persist_exists(uint32_t key) {
+  return persistSlots[key % PERSIST_SLOTS].used;
+}
+
+int persist_write_data(uint32_t key, const void* data, size_t size) {
+  if(size > PERSIST_DATA_MAX_LENGTH) {
+    size = PERSIST_DATA_MAX_LENGTH;
+  }
+  persistSlots[key % PERSIST_SLOTS].used = true;
+  persistSlots[key % PERSIST_SLOTS].size = size;
+  memcpy(persistSlots[key % PERSIST_SLOTS].data, data, size);
+  return size;
+}
+
+int persist_read_data(uint32_t key, void* buffer, size_t buffer_size) {
+  if(!persistSlots[key % PERSIST_SLOTS].used) {
+    return -1;
+  }
+  if(buffer_size > persistSlots[key % PERSIST_SLOTS].size) {
+    buffer_size = persistSlots[key % PERSIST_SLOTS].size;
+  }
+  memcpy(buffer, persistSlots[key % PERSIST_SLOTS].data, buffer_size);
+  return buffer_size;
+}
+
+status_t persist_write_int(uint32_t key, int32_t value) {
+  return persist_write_data(key, &value, sizeof(value));
+}
+
+int32_t persist_read_int(uint32_t key) {
+  int32_t value = 0;
+  persist_read_data(key, &value, sizeof(value));
+  return value;
+}
+
+status_t persist_delete(uint32_t key) {
+  persistSlots[key % PERSIST_SLOTS].used = false;
+  return 0;
+}
+
+void host_clear_persist(void) {
+  memset(persistSlots, 0, sizeof(persistSlots));
+}
+
+void vibes_short_pulse(void) {
+}
+
+void app_event_loop(void) {
+}
+
+// Host controls
+
+// Each layer draws with a fresh context, offset to where it is on screen
+// and clipped to its frame and its parent's
+static void renderLayer(Layer* layer, GPoint origin, GRect clip) {
+  if(layer->hidden) {
+    return;
+  }
+  origin.x += layer->frame.origin.x;
+  origin.y += layer->frame.origin.y;
+  clip = intersectRects(clip, GRect(origin.x, origin.y, layer->frame.size.w, layer->frame.size.h));
+  if(layer->updateProc) {
+    GContext ctx = { GColorBlack, GColorBlack, GColorBlack, origin, clip };
+    layer->updateProc(layer, &ctx);
+  }
+  for(int i = 0; i < layer->childCount; i++) {
+    renderLayer(layer->children[i], origin, clip);
+  }
+}
+
+static uint32_t countTouched(void) {
+  uint32_t count = 0;
+  for(size_t i = 0; i < sizeof(touched) / sizeof(touched[0]); i++) {
+    count += __builtin_popcount(touched[i]);
+  }
+  return count;
+}
+
+// FNV-1a of the whole screen buffer
+static uint32_t hashScreen(void) {
+  const uint8_t* bytes = (const uint8_t*)screen;
+  uint32_t hash = 2166136261u;
+  for(size_t i = 0; i < sizeof(screen); i++) {
+    hash = (hash ^ bytes[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Like the watch, the screen keeps what was drawn before unless the
+// window has a background color
+void host_render(void) {
+  if(!dirty || !topWindow) {
+    return;
+  }
+  dirty = false;
+  memset(&frameStats, 0, sizeof(frameStats));
+  memset(touched, 0, sizeof(touched));
+  GRect screenRect = GRect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT);
+  if(topWindow->background != GColorClear) {
+    GContext ctx = { GColorBlack, GColorBlack, GColorBlack, GPoint(0, 0), screenRect };
+    fillRect(&ctx, screenRect, topWindow->background);
+  }
+  renderLayer(&topWindow->root, GPoint(0, 0), screenRect);
+  frameStats.touched = countTouched();
+  frameStats.hash = hashScreen();
+  graphicsStats.frames++;
+  if(frameHook) {
+    frameHook(&frameStats);
+  }
+}
+
+void host_set_frame_hook(HostFrameHook hook) {
+  frameHook = hook;
+}
+
+void host_advance(uint32_t ms) {
+  uint64_t end = clockMs + ms;
+  for(;;) {
+    int next = -1;
+    for(int i = 0; i < MAX_TIMERS; i++) {
+      if(timers[i].live && timers[i].due <= end && (next < 0 || timers[i].due < timers[next].due)) {
+        next = i;
+      }
+    }
+    if(accelBatchDue(end) && (next < 0 || nextAccelBatch < timers[next].due)) {
+      if(nextAccelBatch > clockMs) {
+        clockMs = nextAccelBatch;
+      }
+      deliverAccelBatch();
+      continue;
+    }
+    if(next < 0) {
+      break;
+    }
+    if(timers[next].due > clockMs) {
+      clockMs = timers[next].due;
+    }
+    timers[next].live = false;
+    timers[next].callback(timers[next].data);
+    host_render();
+  }
+  clockMs = end;
+}
+
+void host_press(ButtonId button) {
+  if(rawClickHandlers[button].down) {
+    rawClickHandlers[button].down(recognizerFor(button), rawClickHandlers[button].context);
+  }
+  host_render();
+}
+
+void host_release(ButtonId button) {
+  if(rawClickHandlers[button].up) {
+    rawClickHandlers[button].up(recognizerFor(button), rawClickHandlers[button].context);
+  }
+  if(clickHandlers[button]) {
+    clickHandlers[button](recognizerFor(button), clickContext);
+  }
+  host_render();
+}
+
+void host_click(ButtonId button) {
+  host_press(button);
+  host_release(button);
+}
+
+void host_set_accel(int16_t x, int16_t y, int16_t z) {
+  accel.x = x;
+  accel.y = y;
+  accel.z = z;
+}
+
+void host_push_accel(AccelData* data, uint32_t count) {
+  if(accelHandler && count > 0) {
+    accel = data[count - 1];
+    accelHandler(data, count);
+  }
+}
+
+uint64_t host_clock_ms(void) {
+  return clockMs;
+}
+
+const GBitmap* host_frame_buffer(void) {
+  return &screenBitmap;
+}
+
+HostGraphicsStats host_graphics_stats(void) {
+  return graphicsStats;
+}
+
+HostHeapStats host_heap_stats(void) {
+  return heapStats;
+}
+
+void host_reset_stats(void) {
+  memset(&graphicsStats, 0, sizeof(graphicsStats));
+  heapStats.peak = heapStats.used;
+  heapStats.allocations = 0;
+  heapStats.frees = 0;
+}
@@ -0,0 +1,371 @@
+// Plays many seeded games of the real game code with a bot and reports,
+// per level, how often it was cleared, how long the creeps took to kill
+// and how much money the bot had. Every game runs in its own forked
+// process, up to one per core, so games share no state at all.
+//
+//   make sim && ./sim [-g games] [-j jobs] [-l levels] [-s seed] [-b order] [-c]
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "host.h"
+#include "../../src/main.c"
+
+// The tool's own memory doesn't come from the watch sized heap
+#undef malloc
+#undef free
+
+#define DEFAULT_GAMES 200
+#define DEFAULT_LEVELS 16
+#define MAX_SIM_LEVELS 32
+// A level the bot hasn't cleared after ten minutes counts as stalled
+#define LEVEL_TIMEOUT_STEPS (10 * 60 * 1000 / ACCEL_STEP_MS)
+// Creep bullets this close above the ship are dodged
+#define DODGE_HEIGHT 30
+#define DODGE_WIDTH 6
+#define DODGE_DISTANCE 14
+#define STEER_DEAD_ZONE 1
+#define STEER_LAG_STEPS 6
+#define MAX_TILT (ACCEL_MID + FROM_FIXED(SHIP_MAX_SPEED) * ACCEL_PER_PIXEL_SPEED)
+
+typedef enum { LevelNotPlayed, LevelCleared, LevelDied, LevelStalled } LevelOutcome;
+
+typedef struct {
+  uint8_t outcome;
+  uint8_t gunType;
+  uint8_t gunPower;
+  uint8_t fullArmor;
+  int32_t moneyStart;
+  int32_t moneyEnd;
+  uint32_t steps;
+} SimLevel;
+
+// What a game process hands back, small enough for one atomic pipe write
+typedef struct {
+  uint32_t seed;
+  SimLevel levels[MAX_SIM_LEVELS];
+} SimGame;
+
+typedef struct {
+  int games;
+  int jobs;
+  int levels;
+  uint32_t seed;
+  // Store selections in the order the bot buys them, empty for a random
+  // order per game
+  char order[8];
+  bool loadouts;
+} SimOptions;
+
+static SimOptions options = { DEFAULT_GAMES, 0, DEFAULT_LEVELS, 1, "tdpa", false };
+
+// Bot
+
+static int shipCenter(){
+  return shipBounds.origin.x + shipBounds.size.w / 2;
+}
+
+// The live creep closest to the ship in x
+static int targetX(){
+  Level* level = getCurrentLevel();
+  int best = shipCenter();
+  int bestDistance = INT32_MAX;
+  for(int i = 0; i < level->liveCount; i++){
+    Creep* creep = &level->creeps[level->live[i]];
+    int x = creep->bounds.origin.x + creep->bounds.size.w / 2;
+    if(ABS(x - shipCenter()) < bestDistance){
+      best = x;
+      bestDistance = ABS(x - shipCenter());
+    }
+  }
+  return best;
+}
+
+// Away from the closest creep bullet about to hit the ship, if any
+static int dodge(int target){
+  int ship = shipCenter();
+  int closest = DODGE_HEIGHT;
+  for(int i = 0; i < creepBullets.count; i++){
+    GPoint bullet = bulletPosition(&creepBullets, i);
+    int above = shipBounds.origin.y - bullet.y;
+    if(above < 0 || above >= closest || ABS(bullet.x - ship) > DODGE_WIDTH) continue;
+    closest = above;
+    target = bullet.x > ship || ship - DODGE_DISTANCE < leftWall ? ship - DODGE_DISTANCE : ship + DODGE_DISTANCE;
+    if(target > rightWall) target = ship - DODGE_DISTANCE;
+  }
+  return target;
+}
+
+// Tilts the watch so the ship heads for the target, slowing down as it
+// gets close. Samples reach the game a batch at a time through a filter,
+// so the ship keeps moving for a few steps after the tilt changes.
+static void steer(){
+  int dx = dodge(targetX()) - shipCenter();
+  int tilt = ABS(dx) <= STEER_DEAD_ZONE ? 0 : ACCEL_MID + ABS(dx) * ACCEL_PER_PIXEL_SPEED / STEER_LAG_STEPS;
+  tilt = MIN(tilt, MAX_TILT);
+  host_set_accel(dx < 0 ? -tilt : tilt, 0, 0);
+}
+
+static int storeSelectionFor(char item){
+  switch(item){
+    case 'a': return ARMOR_SELECTION;
+    case 'p': return POWER_UP_SELECTION;
+    case 'd': return DOUBLE_GUN_SELECTION;
+    case 't': return TRIPLE_GUN_SELECTION;
+  }
+  return -1;
+}
+
+// The store swaps a triple gun for a double one if asked to
+static bool isUpgrade(int selection){
+  if(selection == DOUBLE_GUN_SELECTION) return gunType == DEFAULT_GUN;
+  if(selection == TRIPLE_GUN_SELECTION) return gunType != TRIPLE_GUN;
+  return true;
+}
+
+// Buys what it can afford in order, as many of each as the store sells,
+// then leaves for the next level
+static void shop(const char* order){
+  for(const char* item = order; *item; item++){
+    storeSelection = storeSelectionFor(*item);
+    if(!isUpgrade(storeSelection)) continue;
+    int money;
+    do{
+      money = player.money;
+      host_click(BUTTON_ID_SELECT);
+    }while(player.money < money);
+  }
+  storeSelection = DONE_SELECTION;
+  host_click(BUTTON_ID_SELECT);
+}
+
+static void shuffledOrder(char* order, uint32_t seed){
+  strcpy(order, "adpt");
+  srand(seed);
+  for(int i = 3; i > 0; i--){
+    int j = rand() % (i + 1);
+    char swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+}
+
+// One game, played in the process it was forked into
+static void playGame(uint32_t seed, SimGame* result){
+  memset(result, 0, sizeof(*result));
+  result->seed = seed;
+  char order[sizeof(options.order)];
+  if(options.order[0]) strcpy(order, options.order);
+  else shuffledOrder(order, seed);
+
+  gameSeed = seed;
+  handle_init();
+  host_render();
+  host_advance(0);
+  host_click(BUTTON_ID_SELECT);
+
+  SimLevel* current = NULL;
+  int startTime = 0;
+  while(game.currentLevel < options.levels){
+    host_advance(ACCEL_STEP_MS);
+    if(game.state == LevelState && current == NULL){
+      current = &result->levels[game.currentLevel];
+      current->gunType = gunType;
+      current->gunPower = currentGunPower;
+      current->fullArmor = player.fullArmor;
+      current->moneyStart = player.money;
+      startTime = gameTime;
+    }
+    if(current == NULL){
+      if(game.state == StoreState) shop(order);
+      continue;
+    }
+    current->steps = gameTime - startTime;
+    current->moneyEnd = player.money;
+    if(game.state == StoreState){
+      current->outcome = LevelCleared;
+      current = NULL;
+      if(game.currentLevel < options.levels) shop(order);
+    }else if(game.state == GameOverState){
+      current->outcome = LevelDied;
+      break;
+    }else if(current->steps > LEVEL_TIMEOUT_STEPS){
+      current->outcome = LevelStalled;
+      break;
+    }else{
+      steer();
+    }
+  }
+  handle_deinit();
+}
+
+// Running games
+
+static bool readResult(int fd, SimGame* game){
+  size_t done = 0;
+  while(done < sizeof(*game)){
+    ssize_t got = read(fd, (uint8_t*)game + done, sizeof(*game) - done);
+    if(got < 0 && errno == EINTR) continue;
+    if(got <= 0) return false;
+    done += got;
+  }
+  return true;
+}
+
+static void startGame(int fd, uint32_t seed){
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid < 0){
+    perror("fork");
+    exit(1);
+  }
+  if(pid > 0) return;
+  SimGame result;
+  playGame(seed, &result);
+  _exit(write(fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+}
+
+static void runGames(SimGame* results){
+  int fds[2];
+  if(pipe(fds) != 0){
+    perror("pipe");
+    exit(1);
+  }
+  int started = 0;
+  for(; started < options.games && started < options.jobs; started++) startGame(fds[1], options.seed + started);
+  for(int finished = 0; finished < options.games; finished++){
+    if(!readResult(fds[0], &results[finished])){
+      fprintf(stderr, "a game process died\n");
+      exit(1);
+    }
+    while(waitpid(-1, NULL, WNOHANG) > 0);
+    if(started < options.games) startGame(fds[1], options.seed + started++);
+  }
+  while(wait(NULL) > 0);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Report
+
+static int compareSteps(const void* a, const void* b){
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+static double stepsToSeconds(double steps){
+  return steps * ACCEL_STEP_MS / 1000;
+}
+
+static void reportLevels(SimGame* results){
+  uint32_t* clearSteps = malloc(sizeof(uint32_t) * options.games);
+  printf("%5s %6s %7s %5s %7s %8s %8s %8s %8s %6s %6s %6s %6s\n", "level", "played", "cleared", "died",
+    "stalled", "kill s", "p90 s", "$ start", "$ end", "power", "armor", "double", "triple");
+  for(int levelIndex = 0; levelIndex < options.levels; levelIndex++){
+    int played = 0, cleared = 0, died = 0, stalled = 0, doubles = 0, triples = 0;
+    double moneyStart = 0, moneyEnd = 0, power = 0, armor = 0, killSteps = 0;
+    for(int i = 0; i < options.games; i++){
+      SimLevel* level = &results[i].levels[levelIndex];
+      if(level->outcome == LevelNotPlayed) continue;
+      played++;
+      moneyStart += level->moneyStart;
+      moneyEnd += level->moneyEnd;
+      power += level->gunPower;
+      armor += level->fullArmor;
+      if(level->gunType == DOUBLE_GUN) doubles++;
+      if(level->gunType == TRIPLE_GUN) triples++;
+      if(level->outcome == LevelDied) died++;
+      if(level->outcome == LevelStalled) stalled++;
+      if(level->outcome == LevelCleared){
+        clearSteps[cleared++] = level->steps;
+        killSteps += level->steps;
+      }
+    }
+    if(played == 0) break;
+    double p90 = 0;
+    if(cleared > 0){
+      qsort(clearSteps, cleared, sizeof(uint32_t), compareSteps);
+      p90 = clearSteps[(cleared - 1) * 9 / 10];
+    }
+    printf("%5d %6d %6.1f%% %5d %7d %8.1f %8.1f %8.0f %8.0f %6.1f %6.1f %5.0f%% %5.0f%%\n", levelIndex + 1,
+      played, 100.0 * cleared / played, died, stalled, cleared ? stepsToSeconds(killSteps / cleared) : 0,
+      stepsToSeconds(p90), moneyStart / played, moneyEnd / played, power / played, armor / played,
+      100.0 * doubles / played, 100.0 * triples / played);
+  }
+  free(clearSteps);
+}
+
+// Clear rate of every gun and power a level was played with
+static void reportLoadouts(SimGame* results){
+  static const char* gunNames[] = { "single", "double", "triple" };
+  printf("\n%5s %7s %6s %6s %7s\n", "level", "gun", "power", "played", "cleared");
+  for(int levelIndex = 0; levelIndex < options.levels; levelIndex++){
+    for(int gun = DEFAULT_GUN; gun <= TRIPLE_GUN; gun++){
+      for(int power = INITIAL_GUN_POWER; power <= MAX_POWER; power++){
+        int played = 0, cleared = 0;
+        for(int i = 0; i < options.games; i++){
+          SimLevel* level = &results[i].levels[levelIndex];
+          if(level->outcome == LevelNotPlayed || level->gunType != gun || level->gunPower != power) continue;
+          played++;
+          if(level->outcome == LevelCleared) cleared++;
+        }
+        if(played > 0){
+          printf("%5d %7s %6d %6d %6.1f%%\n", levelIndex + 1, gunNames[gun], power, played,
+            100.0 * cleared / played);
+        }
+      }
+    }
+  }
+}
+
+static void usage(const char* name){
+  fprintf(stderr, "usage: %s [-g games] [-j jobs] [-l levels] [-s seed] [-b order] [-c]\n"
+    "  -b  store items in the order the bot buys them: a armor, p power, d double gun,\n"
+    "      t triple gun, or random for a different order every game (default tdpa)\n"
+    "  -c  also report the clear rate of every gun and power a level was played with\n", name);
+  exit(1);
+}
+
+int main(int argc, char** argv){
+  options.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int option;
+  while((option = getopt(argc, argv, "g:j:l:s:b:c")) != -1){
+    switch(option){
+      case 'g': options.games = atoi(optarg); break;
+      case 'j': options.jobs = atoi(optarg); break;
+      case 'l': options.levels = atoi(optarg); break;
+      case 's': options.seed = strtoul(optarg, NULL, 0); break;
+      case 'b':
+        if(strcmp(optarg, "random") == 0){
+          options.order[0] = 0;
+          break;
+        }
+        if(strlen(optarg) >= sizeof(options.order) || strspn(optarg, "apdt") != strlen(optarg)) usage(argv[0]);
+        strcpy(options.order, optarg);
+        break;
+      case 'c': options.loadouts = true; break;
+      default: usage(argv[0]);
+    }
+  }
+  if(options.games <= 0 || options.jobs <= 0 || options.levels <= 0 || options.levels > MAX_SIM_LEVELS ||
+      options.seed == 0){
+    usage(argv[0]);
+  }
+  if(!getenv("HOST_VERBOSE")) setenv("HOST_QUIET", "1", 1);
+
+  SimGame* results = malloc(sizeof(SimGame) * options.games);
+  if(!results){
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  printf("%d games of up to %d levels, %d at a time, seeds from %u, buying %s\n\n", options.games,
+    options.levels, options.jobs, (unsigned)options.seed, options.order[0] ? options.order : "in random order");
+  runGames(results);
+  reportLevels(results);
+  if(options.loadouts) reportLoadouts(results);
+  free(results);
+  return 0;
+}
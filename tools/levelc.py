@@ -0,0 +1,265 @@
+#!/usr/bin/env python
+#
+# Compiles the human readable level description into the binary level
+# file loaded by the watch app (resources/movement/rules.bin).
+#
+#   python tools/levelc.py [--atlas resources/images/sprites.png] \
+#       resources/movement/levels.txt resources/movement/rules.bin
+#
+# Description format, one statement per line, '#' starts a comment:
+#
+#   ship <x> <y> <width> <height>
+#   sprite <x> <y> <width> <height> [down|aimed|spread|ring]
+#   level
+#   creep <x> <y> health <n> type <n>
+#     move <dx> <dy> wall
+#     move <dx> <dy> distance <pixels>
+#
+# Sprites are rectangles of the sprite atlas image, at most 32 pixels
+# wide as the game keeps one bit mask word per row for hit tests. The
+# ship is the player's, each sprite statement adds a creep type, numbered
+# from 0 in the order they appear. With --atlas the rectangles are checked
+# against the image size.
+#
+# A creep type fires straight down unless its sprite says otherwise:
+# aimed fires at the ship, spread fires three bullets fanning out below and
+# ring fires eight bullets all around.
+#
+# Deltas are pixels per tick and may be fractional (0.5, -1.25). A creep
+# cycles through its moves, switching when it passes a wall or has
+# traveled the given distance. Creeps of a level with the same moves share
+# one copy of them in the output.
+#
+# Output format, all little-endian:
+#
+#   header       magic "PHXL", u16 version, u16 level count,
+#                u32 checksum, u32 file size, u16 sprite count,
+#                2 bytes padding
+#   offsets      u32 per level plus one for the end of the file
+#   sprites      i16 x, i16 y, i16 width, i16 height, u8 fire pattern,
+#                1 byte padding, the ship first then one per creep type
+#   level        u16 creep count, u16 rule count,
+#                creep records then rule records
+#   creep        i16 x, i16 y, u16 first rule, u8 rule count, u8 health,
+#                u8 type, 3 bytes padding
+#   rule         i32 dx, i32 dy (Q8.8), u16 distance, u8 condition,
+#                1 byte padding
+#
+# The checksum is FNV-1a over everything after the offsets.
+
+import math
+import struct
+import sys
+
+MAGIC = b'PHXL'
+VERSION = 3
+HEADER_SIZE = 20
+FIXED_ONE = 256
+WALL = 0
+DISTANCE = 1
+SCREEN_WIDTH = 144
+SCREEN_HEIGHT = 168
+MAX_SPRITE_WIDTH = 32
+MAX_LEVELS = 255
+MAX_CREEPS = 255
+MAX_RULES = 255
+FIRE_PATTERNS = ['down', 'aimed', 'spread', 'ring']
+
+
+class LevelError(Exception):
+    pass
+
+
+def fnv1a(data):
+    h = 0x811c9dc5
+    for b in bytearray(data):
+        h = ((h ^ b) * 0x01000193) & 0xffffffff
+    return h
+
+
+def parse_int(text, line, what, low, high):
+    try:
+        value = int(text)
+    except ValueError:
+        raise LevelError('line %d: %s must be a whole number, got %r' % (line, what, text))
+    if not low <= value <= high:
+        raise LevelError('line %d: %s must be between %d and %d, got %d' % (line, what, low, high, value))
+    return value
+
+
+def parse_fixed(text, line, what):
+    try:
+        value = float(text)
+    except ValueError:
+        raise LevelError('line %d: %s must be a number, got %r' % (line, what, text))
+    if math.isinf(value) or math.isnan(value):
+        raise LevelError('line %d: %s must be a finite number, got %r' % (line, what, text))
+    fixed = int(round(value * FIXED_ONE))
+    if fixed / float(FIXED_ONE) != value:
+        raise LevelError('line %d: %s %s is not a multiple of 1/%d' % (line, what, text, FIXED_ONE))
+    if abs(fixed) > 16 * FIXED_ONE:
+        raise LevelError('line %d: %s %s is faster than 16 pixels per tick' % (line, what, text))
+    return fixed
+
+
+def parse_sprite(words, line, atlas):
+    fire = 0
+    if words[0] == 'sprite' and len(words) == 6:
+        if words[5] not in FIRE_PATTERNS:
+            raise LevelError('line %d: fire pattern must be one of %s, got %r' %
+                             (line, ', '.join(FIRE_PATTERNS), words[5]))
+        fire = FIRE_PATTERNS.index(words[5])
+        words = words[:5]
+    if len(words) != 5:
+        raise LevelError('line %d: expected "%s <x> <y> <width> <height>%s"' %
+                         (line, words[0], ' [pattern]' if words[0] == 'sprite' else ''))
+    x = parse_int(words[1], line, 'x', 0, 32767)
+    y = parse_int(words[2], line, 'y', 0, 32767)
+    width = parse_int(words[3], line, 'width', 1, MAX_SPRITE_WIDTH)
+    height = parse_int(words[4], line, 'height', 1, SCREEN_HEIGHT)
+    if atlas and (x + width > atlas[0] or y + height > atlas[1]):
+        raise LevelError('line %d: sprite is outside the %dx%d atlas' % (line, atlas[0], atlas[1]))
+    return (x, y, width, height, fire)
+
+
+def parse(source, atlas=None):
+    levels = []
+    ship = None
+    sprites = []
+    creep = None
+    for number, raw in enumerate(source.splitlines(), 1):
+        words = raw.split('#', 1)[0].split()
+        if not words:
+            continue
+        keyword = words[0]
+        if keyword == 'ship':
+            if ship is not None:
+                raise LevelError('line %d: the ship is already defined' % number)
+            ship = parse_sprite(words, number, atlas)
+        elif keyword == 'sprite':
+            sprites.append(parse_sprite(words, number, atlas))
+        elif keyword == 'level':
+            if len(words) != 1:
+                raise LevelError('line %d: level takes no arguments' % number)
+            levels.append([])
+            creep = None
+        elif keyword == 'creep':
+            if not levels:
+                raise LevelError('line %d: creep outside of a level' % number)
+            if len(words) != 7 or words[3] != 'health' or words[5] != 'type':
+                raise LevelError('line %d: expected "creep <x> <y> health <n> type <n>"' % number)
+            creep = {
+                'line': number,
+                'x': parse_int(words[1], number, 'x', 0, SCREEN_WIDTH - 1),
+                'y': parse_int(words[2], number, 'y', 0, SCREEN_HEIGHT - 1),
+                'health': parse_int(words[4], number, 'health', 1, 255),
+                'type': parse_int(words[6], number, 'type', 0, 255),
+                'rules': [],
+            }
+            levels[-1].append(creep)
+        elif keyword == 'move':
+            if creep is None:
+                raise LevelError('line %d: move outside of a creep' % number)
+            if len(words) == 4 and words[3] == 'wall':
+                condition, distance = WALL, 0
+            elif len(words) == 5 and words[3] == 'distance':
+                condition = DISTANCE
+                distance = parse_int(words[4], number, 'distance', 0, 65535)
+            else:
+                raise LevelError('line %d: expected "move <dx> <dy> wall" or "move <dx> <dy> distance <n>"' % number)
+            dx = parse_fixed(words[1], number, 'dx')
+            dy = parse_fixed(words[2], number, 'dy')
+            if dx == 0 and dy == 0:
+                raise LevelError('line %d: a move without a delta never ends' % number)
+            creep['rules'].append((dx, dy, distance, condition))
+        else:
+            raise LevelError('line %d: unknown statement %r' % (number, keyword))
+
+    if ship is None:
+        raise LevelError('no ship sprite defined')
+    if not sprites:
+        raise LevelError('no creep sprites defined')
+    if not levels:
+        raise LevelError('no levels defined')
+    if len(levels) > MAX_LEVELS:
+        raise LevelError('at most %d levels are supported' % MAX_LEVELS)
+    for index, level in enumerate(levels):
+        if not level:
+            raise LevelError('level %d has no creeps' % (index + 1))
+        if len(level) > MAX_CREEPS:
+            raise LevelError('level %d has more than %d creeps' % (index + 1, MAX_CREEPS))
+        for creep in level:
+            if creep['type'] >= len(sprites):
+                raise LevelError('line %d: type %d has no sprite, there are %d' %
+                                 (creep['line'], creep['type'], len(sprites)))
+            if not creep['rules']:
+                raise LevelError('line %d: creep has no moves' % creep['line'])
+            if len(creep['rules']) > MAX_RULES:
+                raise LevelError('line %d: creep has more than %d moves' % (creep['line'], MAX_RULES))
+    return [ship] + sprites, levels
+
+
+def pack_level(level):
+    rules = []
+    first_rules = {}
+    creeps = b''
+    for creep in level:
+        moves = tuple(creep['rules'])
+        if moves not in first_rules:
+            first_rules[moves] = len(rules)
+            rules.extend(moves)
+        creeps += struct.pack('<hhHBBB3x', creep['x'], creep['y'], first_rules[moves],
+                              len(moves), creep['health'], creep['type'])
+    if len(rules) > 65535:
+        raise LevelError('too many distinct moves in one level')
+    body = b''.join(struct.pack('<iiHBx', dx, dy, distance, condition)
+                    for dx, dy, distance, condition in rules)
+    return struct.pack('<HH', len(level), len(rules)) + creeps + body
+
+
+def compile_levels(source, atlas=None):
+    sprites, levels = parse(source, atlas)
+    table = b''.join(struct.pack('<hhhhBx', *sprite) for sprite in sprites)
+    blocks = [pack_level(level) for level in levels]
+    offsets = []
+    offset = HEADER_SIZE + 4 * (len(blocks) + 1) + len(table)
+    for block in blocks:
+        offsets.append(offset)
+        offset += len(block)
+    offsets.append(offset)
+    data = table + b''.join(blocks)
+    header = MAGIC + struct.pack('<HHIIH2x', VERSION, len(blocks), fnv1a(data), offset, len(sprites))
+    return header + struct.pack('<%dI' % len(offsets), *offsets) + data
+
+
+def png_size(path):
+    with open(path, 'rb') as image:
+        head = image.read(24)
+    if head[:8] != b'\x89PNG\r\n\x1a\n' or head[12:16] != b'IHDR':
+        raise LevelError('%s is not a PNG image' % path)
+    return struct.unpack('>II', head[16:24])
+
+
+def main(argv):
+    args = argv[1:]
+    atlas = None
+    if len(args) == 4 and args[0] == '--atlas':
+        atlas = args[1]
+        args = args[2:]
+    if len(args) != 2:
+        sys.stderr.write('usage: levelc.py [--atlas <sprites.png>] <levels.txt> <rules.bin>\n')
+        return 2
+    with open(args[0]) as source:
+        text = source.read()
+    try:
+        output = compile_levels(text, atlas and png_size(atlas))
+    except LevelError as error:
+        sys.stderr.write('%s: %s\n' % (args[0], error))
+        return 1
+    with open(args[1], 'wb') as target:
+        target.write(output)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))